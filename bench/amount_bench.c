@@ -0,0 +1,82 @@
+/* Microbenchmark of amount_parse(), the parser client amounts go through,
+ * against the paths it replaced: money_parse() (exponents, rounding; still
+ * used for files) and the floating-point parse before fixed-point money,
+ * strtod() or sscanf("%lf") scaled to minor units. server.c is compiled in
+ * with its main renamed:
+ *
+ *   gcc -Wall -Wextra -O2 -pthread bench/amount_bench.c -o amount_bench -lm
+ *   ./amount_bench [iterations]
+ *
+ * Every parser reads the same mix of amounts, as typed by clients, and the
+ * results are summed into a volatile so none of the work is optimised out.
+ * Reports nanoseconds per amount. */
+#define main server_main
+#include "../server.c"
+#undef main
+
+#include <math.h>
+
+static const char *const INPUTS[] = {
+    "12", "12.5", "0.05", "100", "1234567.89", "0.01", "250.00", "99999.99",
+};
+#define NINPUTS (int)(sizeof(INPUTS) / sizeof(INPUTS[0]))
+
+static volatile int64_t g_sink;
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int64_t run_amount_parse(const char *s) {
+    int64_t v = 0;
+    amount_parse(s, 2, &v);
+    return v;
+}
+
+static int64_t run_money_parse(const char *s) {
+    int64_t v = 0;
+    money_parse(s, 2, ROUND_HALF_EVEN, &v);
+    return v;
+}
+
+static int64_t run_strtod(const char *s) {
+    return llround(strtod(s, NULL) * 100);
+}
+
+static int64_t run_sscanf(const char *s) {
+    double d = 0;
+    sscanf(s, "%lf", &d);
+    return llround(d * 100);
+}
+
+static void bench(const char *name, int64_t (*parse)(const char *), long iterations) {
+    int64_t sum = 0;
+    double t0 = seconds();
+    for (long i = 0; i < iterations; i++) sum += parse(INPUTS[i % NINPUTS]);
+    double t = seconds() - t0;
+    g_sink += sum;
+    printf("%-14s %8.1f ns\n", name, t / (double)iterations * 1e9);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+    if (iterations < NINPUTS) iterations = NINPUTS;
+
+    /* the same minor units from every parser, or the comparison is moot */
+    for (int i = 0; i < NINPUTS; i++) {
+        int64_t want = run_amount_parse(INPUTS[i]);
+        if (run_money_parse(INPUTS[i]) != want || run_strtod(INPUTS[i]) != want ||
+            run_sscanf(INPUTS[i]) != want) {
+            fprintf(stderr, "parsers disagree on \"%s\"\n", INPUTS[i]);
+            return 1;
+        }
+    }
+
+    bench("amount_parse", run_amount_parse, iterations);
+    bench("money_parse", run_money_parse, iterations);
+    bench("strtod", run_strtod, iterations);
+    bench("sscanf %lf", run_sscanf, iterations);
+    return 0;
+}
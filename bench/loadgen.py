@@ -0,0 +1,347 @@
+#!/usr/bin/env python3
+"""Load generator for the exchange server.
+
+    gcc -O2 -pthread server.c -o server
+    python3 bench/loadgen.py scale [--sizes 1000,10000,100000,1000000]
+
+Every benchmark starts its own server (port 8080 must be free) in a scratch
+directory and drives it from separate client processes, each on one
+connection with PIPELINE ON, sending a request and waiting for its END
+before the next (closed loop). Latencies are per request, as seen by the
+client.
+
+scale   BALANCES latency against book size. For each size a snapshot with
+        that many accounts is written straight to exchange_db.txt (creating
+        them through the protocol would take far longer than the
+        measurement), the server loads it, and clients query random
+        accounts. Reports load time, p50/p99 latency and the server's
+        resident memory.
+
+contention
+        DEPOSIT throughput against client count, with every client on an
+        account of its own (spread: only stripe locks, which don't collide)
+        and with all of them on one account (hot: one stripe lock for all).
+        Then the writer case: the spread load plus one more client creating
+        accounts, which needs the store lock exclusively while every
+        DEPOSIT holds it shared; its p50/p99 show whether writers starve.
+        Pass --args "--durability relaxed" to take the WAL flush out of
+        the picture and measure the locking alone.
+
+backends
+        --io epoll against --io uring on the same mixed load (DEPOSIT and
+        BALANCES on each client's own account): requests/s and p50/p99
+        latency, then, if strace is installed, syscalls per request from a
+        second, shorter run under strace -f -c (tracing slows the server
+        down too much to time the same run).
+"""
+import argparse
+import multiprocessing
+import os
+import random
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+PORT = 8080
+
+
+# --------- server ----------
+
+def start_server(server, args, cwd):
+    t0 = time.perf_counter()
+    proc = subprocess.Popen([server] + args, cwd=cwd, stdout=subprocess.DEVNULL)
+    while True:
+        # wait for the welcome banner, not just a connect: the listening
+        # socket of a server that just exited can linger for a moment
+        try:
+            with socket.create_connection(("127.0.0.1", PORT)) as probe:
+                probe.settimeout(1)
+                if probe.recv(2) == b"OK":
+                    return proc, time.perf_counter() - t0
+        except OSError:
+            pass
+        if proc.poll() is not None:
+            sys.exit("server exited with status %d" % proc.returncode)
+        time.sleep(0.01)
+
+
+def stop_server(proc):
+    proc.terminate()
+    proc.wait()
+
+
+def rss_mb(pid):
+    """resident memory, including the shared store mapping"""
+    with open("/proc/%d/status" % pid) as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1]) / 1024
+    return 0.0
+
+
+# --------- clients ----------
+
+class Conn:
+    def __init__(self):
+        self.sock = socket.create_connection(("127.0.0.1", PORT))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.file = self.sock.makefile("rb")
+        self.read_reply()
+        self.cmd("PIPELINE ON")
+
+    def read_reply(self):
+        first = None
+        while True:
+            line = self.file.readline()
+            if not line:
+                raise ConnectionError("server closed the connection")
+            if first is None and line != b"READY>\n":
+                first = line
+            if line == b"END\n":
+                return first.decode()
+
+    def cmd(self, line):
+        self.sock.sendall(line.encode() + b"\n")
+        return self.read_reply()
+
+
+def client_main(setup, make_request, requests, client, results):
+    """one client process, number `client`: run the setup lines, then
+    `requests` requests from make_request(rng, client), or fewer if it
+    returns None; reports (client, latencies, errors)"""
+    rng = random.Random(client)
+    conn = Conn()
+    for line in setup:
+        conn.cmd(line)
+    lat, errors = [], 0
+    for _ in range(requests):
+        line = make_request(rng, client)
+        if line is None:
+            break
+        t = time.perf_counter()
+        reply = conn.cmd(line)
+        lat.append(time.perf_counter() - t)
+        errors += not reply.startswith("OK")
+    results.put((client, lat, errors))
+
+
+def run_clients(clients, setup, make_request, requests, apart=()):
+    """requests per client on `clients` concurrent connections; returns
+    (all latencies sorted, errors, wall seconds), leaving out the clients
+    numbered in `apart`, whose latencies come back sorted in a fourth
+    value, {client: latencies}, if any were asked for"""
+    results = multiprocessing.Queue()
+    procs = [multiprocessing.Process(target=client_main,
+                                     args=(setup, make_request, requests, i, results))
+             for i in range(clients)]
+    t0 = time.perf_counter()
+    for p in procs:
+        p.start()
+    lat, errors, kept = [], 0, {}
+    for _ in procs:
+        c, l, e = results.get()
+        if c in apart:
+            kept[c] = sorted(l)
+        else:
+            lat += l
+        errors += e
+    wall = time.perf_counter() - t0
+    for p in procs:
+        p.join()
+    lat.sort()
+    if apart:
+        return lat, errors, wall, kept
+    return lat, errors, wall
+
+
+def pct(lat, q):
+    return lat[min(len(lat) - 1, int(len(lat) * q))] * 1e6
+
+
+# --------- scale ----------
+
+def write_snapshot(path, accounts):
+    """one user owning `accounts` accounts, ids ACC<digits> like the server's"""
+    width = max(4, len(str(accounts)) + 1)
+    first = 10 ** (width - 1)
+    ids = ["ACC%d" % (first + i) for i in range(accounts)]
+    with open(path, "w") as f:
+        f.write("LSN 0\nUSER bench pw\n")
+        for i in range(0, accounts, 100000):
+            f.write("".join("ACC %s IND 1 bench USD=100.00 EUR=0.00 GBP=0.00\n" % a
+                            for a in ids[i:i + 100000]))
+    return ids
+
+
+def bench_scale(opts):
+    print("%10s %9s %9s %9s %9s" % ("accounts", "load s", "p50 us", "p99 us", "rss MB"))
+    for size in [int(s) for s in opts.sizes.split(",")]:
+        work = tempfile.mkdtemp(prefix="loadgen.")
+        try:
+            ids = write_snapshot(os.path.join(work, "exchange_db.txt"), size)
+            proc, load = start_server(opts.server, opts.args, work)
+            try:
+                lat, errors, _ = run_clients(
+                    opts.clients, ["LOGIN bench pw"],
+                    lambda rng, client: "BALANCES " + rng.choice(ids), opts.requests)
+                print("%10d %9.2f %9.0f %9.0f %9.0f%s"
+                      % (size, load, pct(lat, 0.50), pct(lat, 0.99), rss_mb(proc.pid),
+                         "  (%d errors)" % errors if errors else ""))
+            finally:
+                stop_server(proc)
+        finally:
+            shutil.rmtree(work, ignore_errors=True)
+
+
+# --------- contention ----------
+
+def bench_contention(opts):
+    counts = [int(s) for s in opts.counts.split(",")]
+    work = tempfile.mkdtemp(prefix="loadgen.")
+    proc, _ = start_server(opts.server, opts.args, work)
+    try:
+        conn = Conn()
+        conn.cmd("REGISTER bench pw")
+        conn.cmd("LOGIN bench pw")
+        accs = [conn.cmd("CREATE_ACCOUNT IND bench").split()[2] for _ in range(max(counts))]
+
+        print("%8s %8s %10s %9s %9s" % ("clients", "accounts", "req/s", "p50 us", "p99 us"))
+        for n in counts:
+            for pattern in ("spread", "hot"):
+                def make_request(rng, client, spread=(pattern == "spread")):
+                    return "DEPOSIT %s USD 0.01" % accs[client if spread else 0]
+                lat, errors, wall = run_clients(n, ["LOGIN bench pw"], make_request,
+                                                opts.requests)
+                print("%8d %8s %10.0f %9.0f %9.0f%s"
+                      % (n, pattern, len(lat) / wall, pct(lat, 0.50), pct(lat, 0.99),
+                         "  (%d errors)" % errors if errors else ""))
+
+        # clients 0..n-1 deposit as in spread; client n creates a tenth as
+        # many accounts, so it is done well within the depositors' run
+        print("\n%8s %10s %14s %14s" % ("clients", "DEPOSIT/s", "CREATE p50 us",
+                                        "CREATE p99 us"))
+        for n in counts:
+            def make_request(rng, client, n=n, left=[opts.requests // 10]):
+                if client < n:
+                    return "DEPOSIT %s USD 0.01" % accs[client]
+                left[0] -= 1
+                return "CREATE_ACCOUNT IND bench" if left[0] >= 0 else None
+            lat, errors, wall, kept = run_clients(n + 1, ["LOGIN bench pw"], make_request,
+                                                  opts.requests, apart=(n,))
+            created = kept[n]
+            print("%8d %10.0f %14.0f %14.0f%s"
+                  % (n, len(lat) / wall, pct(created, 0.50) if created else 0,
+                     pct(created, 0.99) if created else 0,
+                     "  (%d errors)" % errors if errors else ""))
+    finally:
+        stop_server(proc)
+        shutil.rmtree(work, ignore_errors=True)
+
+
+# --------- backends ----------
+
+def mixed_request(rng, client, accs):
+    if rng.random() < 0.5:
+        return "DEPOSIT %s USD 0.01" % accs[client]
+    return "BALANCES " + accs[client]
+
+
+def backend_setup(clients):
+    conn = Conn()
+    conn.cmd("REGISTER bench pw")
+    conn.cmd("LOGIN bench pw")
+    return [conn.cmd("CREATE_ACCOUNT IND bench").split()[2] for _ in range(clients)]
+
+
+def strace_calls(path):
+    """total calls in an strace -c summary; the columns are right-aligned
+    under the header and some may be blank, so cut at the header's end of
+    'calls'"""
+    total, end = 0, None
+    with open(path) as f:
+        for line in f:
+            if "calls" in line and "syscall" in line:
+                end = line.index("calls") + len("calls")
+            elif end and line.strip() and not line.startswith("-") and "total" not in line:
+                field = line[:end].split()
+                if field and field[-1].isdigit():
+                    total += int(field[-1])
+    return total
+
+
+def backend_syscalls(opts, io, requests):
+    work = tempfile.mkdtemp(prefix="loadgen.")
+    summary = os.path.join(work, "strace.txt")
+    try:
+        proc, _ = start_server("strace", ["-f", "-c", "-o", summary, opts.server,
+                                          "--io", io] + opts.args, work)
+        try:
+            accs = backend_setup(opts.clients)
+            lat, _, _ = run_clients(opts.clients, ["LOGIN bench pw"],
+                                    lambda rng, client: mixed_request(rng, client, accs),
+                                    requests)
+        finally:
+            # stop the traced server, not strace, so the summary is written
+            with open("/proc/%d/task/%d/children" % (proc.pid, proc.pid)) as f:
+                for pid in f.read().split():
+                    os.kill(int(pid), 15)
+            proc.wait()
+        return strace_calls(summary) / len(lat)
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+
+
+def bench_backends(opts):
+    print("%8s %10s %9s %9s %12s" % ("io", "req/s", "p50 us", "p99 us", "syscalls/req"))
+    for io in opts.backends.split(","):
+        work = tempfile.mkdtemp(prefix="loadgen.")
+        proc, _ = start_server(opts.server, ["--io", io] + opts.args, work)
+        try:
+            accs = backend_setup(opts.clients)
+            lat, errors, wall = run_clients(opts.clients, ["LOGIN bench pw"],
+                                            lambda rng, client: mixed_request(rng, client, accs),
+                                            opts.requests)
+        finally:
+            stop_server(proc)
+            shutil.rmtree(work, ignore_errors=True)
+        calls = "-"
+        if shutil.which("strace"):
+            calls = "%.2f" % backend_syscalls(opts, io, max(1, opts.requests // 5))
+        print("%8s %10.0f %9.0f %9.0f %12s%s"
+              % (io, len(lat) / wall, pct(lat, 0.50), pct(lat, 0.99), calls,
+                 "  (%d errors)" % errors if errors else ""))
+    if not shutil.which("strace"):
+        print("(strace not found: syscalls per request not measured)")
+
+
+# --------- main ----------
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("--server", default="./server", help="server binary (default ./server)")
+    ap.add_argument("--clients", type=int, default=4, help="client processes (default 4)")
+    ap.add_argument("--requests", type=int, default=5000,
+                    help="requests per client (default 5000)")
+    ap.add_argument("--args", default="", help="extra server options, e.g. \"--io fork\"")
+    sub = ap.add_subparsers(dest="bench", required=True)
+    sp = sub.add_parser("scale", help="BALANCES latency against book size")
+    sp.add_argument("--sizes", default="1000,10000,100000,1000000",
+                    help="comma-separated account counts")
+    sp = sub.add_parser("contention", help="DEPOSIT throughput against client count")
+    sp.add_argument("--counts", default="1,2,4,8,16,32",
+                    help="comma-separated client counts")
+    sp = sub.add_parser("backends", help="epoll against io_uring")
+    sp.add_argument("--backends", default="epoll,uring",
+                    help="comma-separated --io values")
+    opts = ap.parse_args()
+    opts.server = os.path.abspath(opts.server)
+    opts.args = opts.args.split()
+    {"scale": bench_scale, "contention": bench_contention,
+     "backends": bench_backends}[opts.bench](opts)
+
+
+if __name__ == "__main__":
+    main()
@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
 #define PORT 8080
 #define BUFFER_SIZE 512
@@ -20,17 +23,35 @@ static void trim_newline(char *s) {
     }
 }
 
+/* socket receive buffer: filled in large chunks, split into lines with memchr */
+static char rbuf[4096];
+static size_t rbufOff, rbufLen;
+
 /* read one line (ending with '\n') from socket */
 static int recv_line(int fd, char *buf, size_t bufsz) {
     size_t i = 0;
 
     while (i + 1 < bufsz) {
-        char c;
-        ssize_t r = read(fd, &c, 1);
-        if (r == 0) return 0;        /* connection closed */
-        if (r < 0) return -1;        /* error */
-        buf[i++] = c;
-        if (c == '\n') break;
+        if (rbufOff == rbufLen) {
+            ssize_t r = read(fd, rbuf, sizeof(rbuf));
+            if (r == 0) return 0;    /* connection closed */
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                return -1;           /* error */
+            }
+            rbufOff = 0;
+            rbufLen = (size_t)r;
+        }
+
+        size_t avail = rbufLen - rbufOff;
+        if (avail > bufsz - 1 - i) avail = bufsz - 1 - i;
+        char *nl = memchr(rbuf + rbufOff, '\n', avail);
+        size_t n = nl ? (size_t)(nl - (rbuf + rbufOff)) + 1 : avail;
+
+        memcpy(buf + i, rbuf + rbufOff, n);
+        rbufOff += n;
+        i += n;
+        if (nl) break;
     }
 
     buf[i] = '\0';
@@ -53,9 +74,79 @@ static void read_until_end(int sockfd) {
     }
 }
 
+/* --pipeline: stream every stdin command without waiting for its reply,
+ * reading the END-terminated responses as they come back (in order).
+ * Sending and receiving are interleaved with poll() so neither side can
+ * stall with a full socket buffer. */
+static void run_pipeline(int sockfd) {
+    static char out[65536];
+    size_t outLen = 0;
+    long outstanding = 0;
+    int inputDone = 0;
+    char line[BUFFER_SIZE];
+
+    /* turn off READY> prompts: one response per command from here on */
+    outLen = (size_t)snprintf(out, sizeof(out), "PIPELINE ON\n");
+    outstanding = 1;
+
+    while (!inputDone || outLen > 0 || outstanding > 0) {
+        /* top up the send buffer from stdin */
+        while (!inputDone && outLen + BUFFER_SIZE <= sizeof(out)) {
+            if (!fgets(line, sizeof(line), stdin)) {
+                inputDone = 1;
+                break;
+            }
+            trim_newline(line);
+            if (line[strspn(line, " \t\r")] == '\0')
+                continue;            /* blank lines get no response */
+
+            int n = snprintf(out + outLen, sizeof(out) - outLen, "%s\n", line);
+            if (n < 0 || n >= BUFFER_SIZE) {
+                fprintf(stderr, "Input too long.\n");
+                continue;
+            }
+            outLen += (size_t)n;
+            outstanding++;
+
+            if (strncmp(line, "QUIT", 4) == 0)
+                inputDone = 1;       /* server closes after QUIT */
+        }
+
+        /* replies already sitting in rbuf would not wake poll() */
+        if (outstanding > 0 && rbufOff < rbufLen) {
+            read_until_end(sockfd);
+            outstanding--;
+            continue;
+        }
+
+        struct pollfd pfd = { sockfd, POLLIN | (outLen > 0 ? POLLOUT : 0), 0 };
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            errMsg("poll");
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t w = send(sockfd, out, outLen, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    errMsg("write");
+            } else {
+                memmove(out, out + w, outLen - (size_t)w);
+                outLen -= (size_t)w;
+            }
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            read_until_end(sockfd);
+            outstanding--;
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
+    int pipeline = (argc == 3 && strcmp(argv[2], "--pipeline") == 0);
+    if (argc != 2 && !pipeline) {
+        fprintf(stderr, "Usage: %s <server_ip> [--pipeline]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -80,6 +171,15 @@ int main(int argc, char *argv[]) {
     /* welcome block */
     read_until_end(sockfd);
 
+    if (pipeline) {
+        char srv[BUFFER_SIZE];
+        if (recv_line(sockfd, srv, sizeof(srv)) <= 0)   /* first READY> */
+            errMsg("read");
+        run_pipeline(sockfd);
+        close(sockfd);
+        return 0;
+    }
+
     char line[BUFFER_SIZE];
     char srv[BUFFER_SIZE];
 
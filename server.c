@@ -1,27 +1,57 @@
-/* server.c - Currency Exchange Server (TCP, fork per client, file-locking DB)
+/* server.c - Currency Exchange Server (TCP, epoll worker threads or fork per client,
+ *            shared in-memory DB)
  * Protocol: EVERY server response ends with "END\n"
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <endian.h>
 
 #define PORT 8080
-#define BUFFER_SIZE 512
+#define BUFFER_SIZE 512      /* longest command line accepted, including '\n' */
+#define IN_BUF_SIZE 4096     /* per-connection receive buffer */
+#define FRAME_MAX BUFFER_SIZE /* largest binary request payload */
+#define BATCH_MAX 4096       /* operations in one BATCH */
+#define OUT_HIGH_WATER 65536  /* stop reading a client whose replies pile up */
+#define OUT_KEEP 16384        /* drained output buffers above this are freed */
+#define MAX_EVENTS 64
+#define URING_ENTRIES 256     /* submission queue of an io_uring worker */
+#define URING_CQ_ENTRIES 16384 /* ...and its completion queue */
 
 #define DB_FILE "exchange_db.txt"
+#define BIN_FILE "exchange_db.bin"
+#define WAL_FILE "exchange_db.wal"
+#define WAL_OLD_FILE WAL_FILE ".old"  /* the log a running checkpoint covers */
+#define SNAPSHOT_BUF (1 << 20)       /* stdio buffer for text snapshots */
 
-#define MAX_USERS 200
-#define MAX_ACCOUNTS 500
 #define MAX_OWNERS 5
 
 #define USERNAME_LEN 32
@@ -29,34 +59,98 @@
 #define ACCID_LEN 32
 #define INT_LEN 12
 
-typedef enum { CUR_USD = 0, CUR_EUR = 1, CUR_GBP = 2, CUR_COUNT = 3 } Currency;
-
-static const char *CUR_NAMES[CUR_COUNT] = { "USD", "EUR", "GBP" };
-
-/* Rates: 1 unit of FROM -> ? units of TO */
-static double rate(Currency from, Currency to) {
-    /* base values relative to EUR (approx example): 1 EUR = 1.10 USD, 1 EUR = 0.85 GBP */
-    double eur_to_usd = 1.10;
-    double eur_to_gbp = 0.85;
-
-    double val_in_eur;
-
-    if (from == to) return 1.0;
-
-    /* Convert FROM to EUR */
-    if (from == CUR_EUR) val_in_eur = 1.0;
-    else if (from == CUR_USD) val_in_eur = 1.0 / eur_to_usd;
-    else /* GBP */ val_in_eur = 1.0 / eur_to_gbp;
+/* Records live in fixed-size chunks carved out of the shared arena as the
+ * DB grows, so a record never moves once created. */
+#define USER_CHUNK 1024
+#define ACC_CHUNK 1024
+#define MAX_CHUNKS 65536     /* up to 64M users and 64M accounts */
+#define HASH_MIN_SLOTS 1024  /* indexes double from here at 50% load */
+#define READER_BUCKETS 64    /* spread index readers' epoch counters */
+#define FORK_READERS 1024    /* --io fork: per-child epoch counters */
+#define ARENA_GB 64          /* default address space reserved for the store */
+
+/* balance updates lock a stripe rather than the whole store */
+#define ACC_LOCK_STRIPES 1024
+#define MAX_LOCK_SET 16      /* accounts a single operation may lock at once */
+
+/* WAL records queued for the writer thread, and how much it writes at once */
+#define WAL_RING 4096
+#define WAL_REC_MAX 512
+#define WAL_BATCH_BYTES (256 << 10)
+
+/* ISO 4217 currencies and the decimal digits of their minor unit. A
+ * currency is referred to by its index here; files store the code. */
+typedef struct {
+    char code[4];
+    int digits;
+} CurrencyInfo;
+
+static const CurrencyInfo CURRENCIES[] = {
+    { "AED", 2 }, { "AFN", 2 }, { "ALL", 2 }, { "AMD", 2 }, { "ANG", 2 }, { "AOA", 2 },
+    { "ARS", 2 }, { "AUD", 2 }, { "AWG", 2 }, { "AZN", 2 }, { "BAM", 2 }, { "BBD", 2 },
+    { "BDT", 2 }, { "BGN", 2 }, { "BHD", 3 }, { "BIF", 0 }, { "BMD", 2 }, { "BND", 2 },
+    { "BOB", 2 }, { "BRL", 2 }, { "BSD", 2 }, { "BTN", 2 }, { "BWP", 2 }, { "BYN", 2 },
+    { "BZD", 2 }, { "CAD", 2 }, { "CDF", 2 }, { "CHF", 2 }, { "CLF", 4 }, { "CLP", 0 },
+    { "CNY", 2 }, { "COP", 2 }, { "CRC", 2 }, { "CUP", 2 }, { "CVE", 2 }, { "CZK", 2 },
+    { "DJF", 0 }, { "DKK", 2 }, { "DOP", 2 }, { "DZD", 2 }, { "EGP", 2 }, { "ERN", 2 },
+    { "ETB", 2 }, { "EUR", 2 }, { "FJD", 2 }, { "FKP", 2 }, { "GBP", 2 }, { "GEL", 2 },
+    { "GHS", 2 }, { "GIP", 2 }, { "GMD", 2 }, { "GNF", 0 }, { "GTQ", 2 }, { "GYD", 2 },
+    { "HKD", 2 }, { "HNL", 2 }, { "HTG", 2 }, { "HUF", 2 }, { "IDR", 2 }, { "ILS", 2 },
+    { "INR", 2 }, { "IQD", 3 }, { "IRR", 2 }, { "ISK", 0 }, { "JMD", 2 }, { "JOD", 3 },
+    { "JPY", 0 }, { "KES", 2 }, { "KGS", 2 }, { "KHR", 2 }, { "KMF", 0 }, { "KPW", 2 },
+    { "KRW", 0 }, { "KWD", 3 }, { "KYD", 2 }, { "KZT", 2 }, { "LAK", 2 }, { "LBP", 2 },
+    { "LKR", 2 }, { "LRD", 2 }, { "LSL", 2 }, { "LYD", 3 }, { "MAD", 2 }, { "MDL", 2 },
+    { "MGA", 2 }, { "MKD", 2 }, { "MMK", 2 }, { "MNT", 2 }, { "MOP", 2 }, { "MRU", 2 },
+    { "MUR", 2 }, { "MVR", 2 }, { "MWK", 2 }, { "MXN", 2 }, { "MYR", 2 }, { "MZN", 2 },
+    { "NAD", 2 }, { "NGN", 2 }, { "NIO", 2 }, { "NOK", 2 }, { "NPR", 2 }, { "NZD", 2 },
+    { "OMR", 3 }, { "PAB", 2 }, { "PEN", 2 }, { "PGK", 2 }, { "PHP", 2 }, { "PKR", 2 },
+    { "PLN", 2 }, { "PYG", 0 }, { "QAR", 2 }, { "RON", 2 }, { "RSD", 2 }, { "RUB", 2 },
+    { "RWF", 0 }, { "SAR", 2 }, { "SBD", 2 }, { "SCR", 2 }, { "SDG", 2 }, { "SEK", 2 },
+    { "SGD", 2 }, { "SHP", 2 }, { "SLE", 2 }, { "SOS", 2 }, { "SRD", 2 }, { "SSP", 2 },
+    { "STN", 2 }, { "SVC", 2 }, { "SYP", 2 }, { "SZL", 2 }, { "THB", 2 }, { "TJS", 2 },
+    { "TMT", 2 }, { "TND", 3 }, { "TOP", 2 }, { "TRY", 2 }, { "TTD", 2 }, { "TWD", 2 },
+    { "TZS", 2 }, { "UAH", 2 }, { "UGX", 0 }, { "USD", 2 }, { "UYI", 0 }, { "UYU", 2 },
+    { "UYW", 4 }, { "UZS", 2 }, { "VES", 2 }, { "VND", 0 }, { "VUV", 0 }, { "WST", 2 },
+    { "XAF", 0 }, { "XCD", 2 }, { "XOF", 0 }, { "XPF", 0 }, { "YER", 2 }, { "ZAR", 2 },
+    { "ZMW", 2 }, { "ZWG", 2 },
+};
+#define CUR_MAX ((int)(sizeof(CURRENCIES) / sizeof(CURRENCIES[0])))
+#define CUR_CODE(c) (CURRENCIES[c].code)
+#define CUR_DIGITS(c) (CURRENCIES[c].digits)
+
+/* every account starts out holding these, so BALANCES always lists them */
+static const char *const ACC_OPEN_CURRENCIES[] = { "USD", "EUR", "GBP" };
+#define ACC_CURRENCIES 16    /* currencies one account may hold at once */
+
+/* Money is an int64 count of the currency's minor unit, so balances add and
+ * compare exactly. */
+#define MONEY_MAX 1000000000000000000LL /* largest amount or balance, in minor units */
+#define MONEY_STR 24         /* room for any int64 with sign and decimal point */
+
+/* exchange rates are fixed point: units of TO per unit of FROM, times RATE_SCALE */
+#define RATE_DIGITS 9
+#define RATE_SCALE 1000000000LL
+
+/* built-in quotes, used without --rates: 1 EUR = 1.10 USD = 0.85 GBP */
+#define DEFAULT_RATE_BASE "EUR"
+static const struct {
+    const char *code;
+    int64_t quote;
+} DEFAULT_QUOTES[] = { { "USD", 1100000000LL }, { "EUR", RATE_SCALE }, { "GBP", 850000000LL } };
 
-    /* Convert EUR to TO */
-    if (to == CUR_EUR) return val_in_eur;
-    else if (to == CUR_USD) return val_in_eur * eur_to_usd;
-    else /* GBP */ return val_in_eur * eur_to_gbp;
-}
+typedef struct {
+    int cur;                   /* CURRENCIES index */
+    int64_t minor;
+} Balance;
 
 typedef struct {
     char username[USERNAME_LEN];
     char password[PASS_LEN];
+    atomic_int ownedHead;     /* accounts this user owns, oldest first (-1 = none) */
+    int ownedTail;
+    int slot;                 /* record number in BIN_FILE */
+    int dirtyNext;            /* link in db->dirtyUsers */
+    atomic_int dirty;
 } User;
 
 typedef struct {
@@ -64,53 +158,552 @@ typedef struct {
     int isJoint; /* 0 individual, 1 joint */
     int ownerCount;
     char owners[MAX_OWNERS][USERNAME_LEN];
-    double bal[CUR_COUNT];
+    int ownerIdx[MAX_OWNERS];  /* user index of owners[k], -1 if unknown */
+    atomic_int ownedNext[MAX_OWNERS]; /* next account owned by owners[k] (-1 = end) */
+    atomic_uint seq;           /* seqlock over bal: odd while an update is in progress */
+    int balCount;              /* currencies held, in the order first used */
+    Balance bal[ACC_CURRENCIES];
+    int slot;                  /* record number in BIN_FILE */
+    long long fileLsn;         /* the BIN_FILE record reflects the WAL up to here */
+    int dirtyNext;             /* link in db->dirtyAccs */
+    atomic_int dirty;
 } Account;
 
+/* One open-addressing slot: the key's hash is cached so probes only strcmp
+ * on a real candidate. ref is index + 1, so a zeroed table is empty; it is
+ * stored last (release), so a reader that sees it also sees the record. */
 typedef struct {
-    User users[MAX_USERS];
+    uint32_t hash;
+    atomic_int ref;
+} HashSlot;
+
+/* Indexes are read without locks. Growing one builds a bigger copy and
+ * publishes it with a single pointer store; the old copy is only freed
+ * once no reader can still be probing it (see epoch_synchronize). */
+typedef struct {
+    uint32_t slots;          /* power of two */
+    HashSlot slot[];
+} HashIndex;
+
+/* Dense cross-rate matrix, rebuilt from the quotes whenever they change:
+ * rate[from * count + to] converts FROM to TO. Published like the indexes,
+ * with one pointer store; see rates_publish. */
+typedef struct {
+    uint64_t version;        /* bumped on every publish */
+    int count;               /* currencies quoted; the matrix is count x count */
+    int base;                /* the quotes were "1 <base> = x <cur>" */
+    int16_t pos[CUR_MAX];    /* currency -> row/column, -1 if not quoted */
+    int16_t cur[CUR_MAX];    /* row -> currency, in the order quoted */
+    int64_t rate[];          /* RATE_SCALE fixed point */
+} RateTable;
+
+typedef struct {
+    long long lsn;           /* last WAL record reflected in this image */
+
+    User *userChunks[MAX_CHUNKS];
     int userCount;
 
-    Account accounts[MAX_ACCOUNTS];
+    Account *accChunks[MAX_CHUNKS];
     int accCount;
+
+    /* in-memory only, rebuilt on load: username -> user, id -> account */
+    _Atomic(HashIndex *) userHash;
+    _Atomic(HashIndex *) accHash;
+
+    /* binary format: records changed since the last flush (-1 = none) */
+    int slotCount;
+    int trackDirty;
+    atomic_int dirtyUsers;
+    atomic_int dirtyAccs;
 } DB;
 
+static inline User *db_user(DB *db, int idx) {
+    return &db->userChunks[idx / USER_CHUNK][idx % USER_CHUNK];
+}
+
+static inline Account *db_account(DB *db, int idx) {
+    return &db->accChunks[idx / ACC_CHUNK][idx % ACC_CHUNK];
+}
+
+/* BIN_FILE is a header followed by fixed 512-byte records, one per user or
+ * account in creation order, so every record has a fixed offset: a change
+ * is written back with one pwrite of its record, and loading is a single
+ * pass over a read-only mapping. Native byte order. Each record carries the
+ * lsn it was written at; replay skips WAL records it already reflects, so a
+ * flush interrupted half way is harmless. */
+#define BIN_MAGIC "CXDB\0\0\0\3"
+#define BIN_VERSION 3
+#define BIN_REC_SIZE 512
+#define BIN_GROW 1024        /* records BIN_FILE is extended by when mapped */
+
+enum { BIN_FREE = 0, BIN_USER = 1, BIN_ACC = 2 };
+
+typedef struct {
+    char magic[8];
+    uint32_t recSize;
+    uint32_t reserved0;
+    int64_t lsn;             /* all records reflect the WAL up to here */
+    char reserved[BIN_REC_SIZE - 24];
+} BinHeader;
+
+typedef struct {
+    uint32_t tag;            /* BIN_USER / BIN_ACC; BIN_FREE = never written */
+    uint32_t isJoint;
+    int64_t lsn;
+    char name[USERNAME_LEN]; /* username or account id */
+    int32_t ownerCount;
+    int32_t balCount;
+    union {
+        char password[PASS_LEN];
+        char owners[MAX_OWNERS][USERNAME_LEN];
+    } u;
+    struct {
+        char code[4];        /* ISO 4217, NUL terminated */
+        int32_t reserved0;
+        int64_t minor;
+    } bal[ACC_CURRENCIES];
+    char reserved[40];
+} BinRecord;
+
+/* versions 1 and 2: 256-byte records with fixed USD, EUR, GBP balances,
+ * as doubles (1) or minor units (2); upgraded on load */
+#define BIN_V2_REC_SIZE 256
+typedef struct {
+    uint32_t tag;
+    uint32_t isJoint;
+    int64_t lsn;
+    char name[USERNAME_LEN];
+    int32_t ownerCount;
+    int32_t reserved0;
+    union {
+        double v1[3];
+        int64_t v2[3];
+    } bal;
+    union {
+        char password[PASS_LEN];
+        char owners[MAX_OWNERS][USERNAME_LEN];
+    } u;
+    char reserved[16];
+} BinRecordV2;
+
+_Static_assert(sizeof(BinHeader) == BIN_REC_SIZE, "BinHeader size");
+_Static_assert(sizeof(BinRecord) == BIN_REC_SIZE, "BinRecord size");
+_Static_assert(sizeof(BinRecordV2) == BIN_V2_REC_SIZE, "BinRecordV2 size");
+
+static off_t bin_offset(int slot) {
+    return (off_t)(slot + 1) * BIN_REC_SIZE;
+}
+
+/* What a snapshot needs from the DB at one lsn, copied out under the store
+ * write lock so the file can be written after it is released. Users, and
+ * accounts but for their balances, never change once created, so text
+ * takes the counts and the balances; binary packs the records changed
+ * since the last flush. */
+typedef struct {
+    long long lsn;
+    int userCount, accCount;
+    int *balCount;           /* text: per account */
+    Balance *bal;            /* ...and their balances, back to back */
+    size_t accCap, balCap;
+    struct { int slot; BinRecord r; } *recs;  /* binary */
+    size_t recCount, recCap;
+} SnapshotCut;
+
+/* Group commit: mutators queue their WAL record (see WalQueue) and carry on;
+ * the writer thread appends everything queued with one write(), covers it with
+ * one fdatasync and then advances durable. With strict durability a reply is
+ * held until durable has passed the lsn of the record behind it. */
+typedef struct {
+    pthread_mutex_t mx;      /* process-shared, guards the fields below */
+    pthread_cond_t flushed;  /* broadcast when durable advances */
+    pthread_cond_t appended; /* signalled on enqueue while the writer sleeps */
+    long long written;       /* highest lsn written to the WAL */
+    atomic_llong durable;    /* highest lsn known to be on disk (read unlocked) */
+
+    /* metrics, see STATS */
+    unsigned long long flushes;
+    unsigned long long records;
+    unsigned long long maxBatch;
+    unsigned long long commits;
+    unsigned long long latencyUsTotal;
+    unsigned long long latencyUsMax;
+} GroupCommit;
+
+/* Lock-free MPSC queue from mutators to the WAL writer. The record with lsn
+ * L goes into cells[L % WAL_RING], so the writer drains strictly in lsn
+ * order without the producers agreeing on anything but the lsn itself. A
+ * cell is reusable once the writer has consumed the lsn WAL_RING below. */
+typedef struct {
+    atomic_llong lsn;        /* lsn of the record held; stored last */
+    long long queuedUs;      /* enqueue time, for the commit latency */
+    int len;
+    char rec[WAL_REC_MAX];
+} WalCell;
+
+typedef struct {
+    atomic_llong consumed;   /* highest lsn the writer has copied out */
+    atomic_int sleeping;     /* writer waits on gc.appended: producers signal */
+    WalCell cells[WAL_RING];
+} WalQueue;
+
+/* An io_uring instance driven by raw syscalls: the mapped submission and
+ * completion rings of one thread. */
+typedef struct {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqEntries;
+    unsigned features;       /* IORING_FEAT_* */
+    unsigned tail;           /* next free sqe; published to *sqTail on submit */
+    unsigned submitted;      /* sqes handed to the kernel so far */
+} Uring;
+
+/* The authoritative DB lives in a shared anonymous mapping created before the
+ * first fork(), so every child sees the same memory. The file is only a
+ * persistence target; it is read once at startup. */
+/* Locking: `lock` guards the structure of db (record arrays, indexes, owner
+ * lists). Creating users or accounts and checkpointing take it exclusively;
+ * balance updates take it shared and then lock the stripes of the accounts
+ * they write, in ascending stripe order. Read-only commands take no lock at
+ * all (see the index epochs and the account seqlock). */
+typedef struct {
+    pthread_rwlock_t lock;   /* process-shared: readers/writers of db */
+    pthread_mutex_t accLocks[ACC_LOCK_STRIPES];
+    pthread_mutex_t walLock; /* orders lsn assignment without a WAL */
+    atomic_long walRecords;  /* WAL records appended since the last checkpoint */
+
+    /* index readers: active count per bucket and epoch parity */
+    atomic_uint epoch;
+    atomic_uint nextReader;
+    struct {
+        atomic_long active[2];
+        char pad[64 - 2 * sizeof(atomic_long)];
+    } readers[READER_BUCKETS];
+    pthread_mutex_t epochLock; /* one epoch_synchronize at a time */
+
+    /* fork mode children count themselves in a slot of their own, held
+       through a robust mutex for their lifetime, so the counters of one
+       that dies inside an epoch can be found and cleared */
+    struct {
+        pthread_mutex_t owner;
+        atomic_long active[2];
+    } forkReaders[FORK_READERS];
+
+    /* exchange rates: readers load `rates` inside an epoch; rateLock
+       serializes publishers, which fill rateSpare and swap it in */
+    _Atomic(RateTable *) rates;
+    RateTable *rateSpare;
+    pthread_mutex_t rateLock;
+
+    size_t arenaSize;        /* bytes reserved for the whole mapping */
+    size_t arenaUsed;        /* bump pointer, guarded by lock */
+    off_t binSize;           /* --persist mmap: current length of BIN_FILE */
+    size_t binMapSize;       /* ...and the address space reserved for it */
+    GroupCommit gc;
+    WalQueue walq;
+    DB db;
+} Store;
+
+static Store *g_store;
+static int g_walfd = -1;
+static int g_binfd = -1;
+static int g_portfd = -1;    /* port_claim's lock; fork children close it */
+static char *g_binmap;       /* BIN_FILE, mapped with --persist mmap */
+static Uring g_walRing;      /* --io uring: the WAL writer's ring */
+static int g_walUring;
+static __thread char *t_dirtyLo, *t_dirtyHi;  /* mapped bytes this thread changed */
+static __thread atomic_long *t_epochActive;  /* this reader's active[2] */
+static __thread long long t_commitLsn;  /* strict epoll reply waits for this lsn */
+
+typedef enum { PERSIST_SNAPSHOT = 0, PERSIST_WAL = 1, PERSIST_MMAP = 2 } PersistMode;
+typedef enum { FORMAT_TEXT = 0, FORMAT_BINARY = 1 } DbFormat;
+typedef enum { IO_EPOLL = 0, IO_FORK = 1, IO_URING = 2 } IoMode;
+typedef enum { ROUND_HALF_EVEN = 0, ROUND_HALF_UP = 1, ROUND_DOWN = 2 } RoundMode;
+typedef enum { DURABILITY_STRICT = 0, DURABILITY_RELAXED = 1 } Durability;
+
+static struct {
+    IoMode io;
+    int threads;             /* epoll workers; 0 = one per online CPU */
+    int backlog;
+    PersistMode persist;
+    DbFormat format;         /* snapshot file: DB_FILE or BIN_FILE */
+    int convertTo;           /* --convert: rewrite in this format and exit (-1 = off) */
+    long checkpointEvery;    /* WAL records between snapshot rewrites */
+    long commitWindowUs;     /* how long the WAL writer waits for company */
+    long commitBatch;        /* ...unless this many records are already pending */
+    Durability durability;   /* relaxed: reply before the WAL record is on disk */
+    long storeGb;            /* address space reserved for the store */
+    RoundMode rounding;      /* exchange results and over-precise amounts */
+    const char *ratesFile;   /* --rates: quotes to start from (NULL = built in) */
+    const char *rateFeed;    /* --rate-feed: UNIX socket for live quotes (NULL = off) */
+} g_cfg = { IO_EPOLL, 0, SOMAXCONN, PERSIST_WAL, FORMAT_TEXT, -1, 1000, 0, 64,
+            DURABILITY_STRICT, ARENA_GB, ROUND_HALF_EVEN, NULL, NULL };
+
+/* One epoll worker thread. Each has its own SO_REUSEPORT listening socket,
+ * so the kernel spreads incoming connections across workers and no accept()
+ * is shared. Sessions whose replies wait for the WAL sit on ackList; the
+ * writer pokes efd when durable advances while any are waiting. */
+typedef struct {
+    int id;
+    int lfd;
+    int ep;
+    int efd;
+    struct Session *ackList;
+    atomic_int ackWaiting;
+    Uring ring;              /* --io uring: replaces ep */
+    uint64_t efdCount;       /* --io uring: target of the eventfd read */
+    pthread_t thread;
+    atomic_ulong accepted;
+    atomic_ulong active;
+    atomic_ulong commands;
+} Worker;
+
+static Worker *g_workers;
+static int g_workerCount;
+
 void errMsg(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
+/* --------- process-shared mutexes ---------- */
+/* The store's mutexes live in the shared mapping and are robust: in fork
+ * mode a child can die holding one, and the next locker then gets
+ * EOWNERDEAD instead of blocking forever. pshared_lock() makes the mutex
+ * usable again and tells the caller, which repairs what the lock guarded.
+ * (There is no robust rwlock; see store_rdlock.) */
+static void pshared_mutex_init(pthread_mutex_t *mx) {
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(mx, &ma) != 0) errMsg("pthread_mutex_init");
+    pthread_mutexattr_destroy(&ma);
+}
+
+/* returns 1 if the previous owner died holding mx, else 0 */
+static int pshared_lock(pthread_mutex_t *mx) {
+    int rc = pthread_mutex_lock(mx);
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(mx);
+        return 1;
+    }
+    if (rc != 0) {
+        errno = rc;
+        errMsg("pthread_mutex_lock");
+    }
+    return 0;
+}
+
+/* pthread_cond_wait/timedwait relock mx and can hit a dead owner too */
+static int pshared_wait(pthread_cond_t *cv, pthread_mutex_t *mx,
+                        const struct timespec *deadline) {
+    int rc = deadline ? pthread_cond_timedwait(cv, mx, deadline)
+                      : pthread_cond_wait(cv, mx);
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(mx);
+        rc = 0;
+    }
+    return rc;
+}
+
 /* --------- file locking (fcntl) ---------- */
-static void lock_file(int fd, short l_type) {
+/* The in-memory store is authoritative, so a second server on the same data
+ * directory would silently diverge from us. The parent holds a write lock on
+ * the WAL for its whole lifetime (fcntl locks are not inherited by children,
+ * and a child closing its copy of the fd does not release the parent's lock). */
+static void lock_instance(int fd) {
     struct flock fl;
     memset(&fl, 0, sizeof(fl));
-    fl.l_type = l_type;      /* F_RDLCK / F_WRLCK */
+    fl.l_type = F_WRLCK;
     fl.l_whence = SEEK_SET;
     fl.l_start = 0;
     fl.l_len = 0;            /* whole file */
-    while (fcntl(fd, F_SETLKW, &fl) == -1) {
+    while (fcntl(fd, F_SETLK, &fl) == -1) {
         if (errno == EINTR) continue;
+        if (errno == EACCES || errno == EAGAIN) {
+            fprintf(stderr, "Another server is already using %s\n", WAL_FILE);
+            exit(EXIT_FAILURE);
+        }
         errMsg("fcntl lock");
     }
 }
 
-static void unlock_file(int fd) {
-    struct flock fl;
-    memset(&fl, 0, sizeof(fl));
-    fl.l_type = F_UNLCK;
-    fl.l_whence = SEEK_SET;
-    fl.l_start = 0;
-    fl.l_len = 0;
-    if (fcntl(fd, F_SETLK, &fl) == -1)
-        errMsg("fcntl unlock");
+/* --------- shared arena ---------- */
+/* The store is one big MAP_NORESERVE reservation; pages only cost memory once
+ * touched. Records and indexes are carved from it with a bump pointer under
+ * the store write lock (or single-threaded at startup), and never move. */
+static void *arena_alloc(size_t size) {
+    size_t off = (g_store->arenaUsed + 4095) & ~(size_t)4095;
+    if (off > g_store->arenaSize || size > g_store->arenaSize - off) return NULL;
+    g_store->arenaUsed = off + size;
+    return (char *)g_store + off;
+}
+
+/* hand a dead allocation's pages back; the address range is not reused */
+static void arena_release(void *p, size_t size) {
+    madvise(p, size, MADV_REMOVE);
+}
+
+/* --------- index epochs ---------- */
+/* Lock-free readers announce themselves in the counter of the current epoch
+ * parity for the duration of one index probe. A writer retiring an index
+ * flips the epoch twice, each time waiting for the previous parity to drain:
+ * after that, every reader that could have loaded the old pointer is gone. */
+static int epoch_enter(void) {
+    if (!t_epochActive) {
+        int b = (int)(atomic_fetch_add(&g_store->nextReader, 1) % READER_BUCKETS);
+        t_epochActive = g_store->readers[b].active;
+    }
+    int p = (int)(atomic_load(&g_store->epoch) & 1);
+    atomic_fetch_add(&t_epochActive[p], 1);
+    return p;
+}
+
+static void epoch_exit(int p) {
+    atomic_fetch_sub_explicit(&t_epochActive[p], 1, memory_order_release);
+}
+
+/* a fork mode child: take a reader slot of our own, kept until exit; with
+ * more children than slots, share a bucket (and lose the recovery) */
+static void epoch_claim_slot(void) {
+    t_epochActive = NULL;
+    for (int i = 0; i < FORK_READERS; i++) {
+        int rc = pthread_mutex_trylock(&g_store->forkReaders[i].owner);
+        if (rc == EOWNERDEAD) pthread_mutex_consistent(&g_store->forkReaders[i].owner);
+        else if (rc != 0) continue;
+        t_epochActive = g_store->forkReaders[i].active;
+        atomic_store(&t_epochActive[0], 0);
+        atomic_store(&t_epochActive[1], 0);
+        return;
+    }
+}
+
+/* wait until no live child counts itself in slot i under parity p; a slot
+ * whose owner died is cleared on the spot */
+static void epoch_drain_slot(int i, int p) {
+    while (atomic_load(&g_store->forkReaders[i].active[p]) != 0) {
+        int rc = pthread_mutex_trylock(&g_store->forkReaders[i].owner);
+        if (rc == EOWNERDEAD || rc == 0) {
+            if (rc == EOWNERDEAD) {
+                fprintf(stderr, "Recovered the epoch slot of a dead worker\n");
+                pthread_mutex_consistent(&g_store->forkReaders[i].owner);
+            }
+            atomic_store(&g_store->forkReaders[i].active[0], 0);
+            atomic_store(&g_store->forkReaders[i].active[1], 0);
+            pthread_mutex_unlock(&g_store->forkReaders[i].owner);
+            return;
+        }
+        sched_yield();
+    }
+}
+
+/* caller holds no epoch */
+static void epoch_synchronize(void) {
+    pshared_lock(&g_store->epochLock);
+    for (int phase = 0; phase < 2; phase++) {
+        int p = (int)(atomic_fetch_add(&g_store->epoch, 1) & 1);
+        for (int b = 0; b < READER_BUCKETS; b++) {
+            while (atomic_load(&g_store->readers[b].active[p]) != 0) sched_yield();
+        }
+        for (int i = 0; g_cfg.io == IO_FORK && i < FORK_READERS; i++) epoch_drain_slot(i, p);
+    }
+    pthread_mutex_unlock(&g_store->epochLock);
+}
+
+/* --------- account seqlock ---------- */
+/* Balance updates happen under the account's stripe lock and are bracketed
+ * by acct_write_begin/end; readers take no lock and retry if a write
+ * overlapped their copy. */
+static void acct_write_begin(Account *a) {
+    atomic_fetch_add_explicit(&a->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void acct_write_end(Account *a) {
+    atomic_fetch_add_explicit(&a->seq, 1, memory_order_release);
+}
+
+/* copy out the balances; returns how many there are */
+static int acct_read_balances(Account *a, Balance bal[ACC_CURRENCIES]) {
+    unsigned s0, s1;
+    int n;
+    do {
+        while ((s0 = atomic_load_explicit(&a->seq, memory_order_acquire)) & 1)
+            sched_yield();
+        n = a->balCount;
+        memcpy(bal, a->bal, sizeof(a->bal));
+        atomic_thread_fence(memory_order_acquire);
+        s1 = atomic_load_explicit(&a->seq, memory_order_relaxed);
+    } while (s0 != s1);
+    return n;
+}
+
+/* slot of cur in a->bal, -1 if the account doesn't hold it */
+static int acct_find(const Account *a, int cur) {
+    for (int k = 0; k < a->balCount; k++)
+        if (a->bal[k].cur == cur) return k;
+    return -1;
+}
+
+/* slot of cur, added at zero if missing (inside a write section, or before
+ * the account is published); -1 if the account already holds the maximum */
+static int acct_slot(Account *a, int cur) {
+    int k = acct_find(a, cur);
+    if (k != -1 || a->balCount == ACC_CURRENCIES) return k;
+    k = a->balCount++;
+    a->bal[k].cur = cur;
+    a->bal[k].minor = 0;
+    return k;
 }
 
 /* --------- helpers ---------- */
+/* three upper-case letters packed into one integer index a flat table
+ * (26^3 entries), so a lookup is a range check and one load */
+static int16_t g_curByCode[26 * 26 * 26];   /* CURRENCIES index + 1, 0 = unknown */
+
+static int cur_key(const char *s) {
+    for (int i = 0; i < 3; i++)
+        if (s[i] < 'A' || s[i] > 'Z') return -1;
+    if (s[3] != '\0') return -1;
+    return ((s[0] - 'A') * 26 + (s[1] - 'A')) * 26 + (s[2] - 'A');
+}
+
+static void currencies_init(void) {
+    for (int c = 0; c < CUR_MAX; c++) g_curByCode[cur_key(CUR_CODE(c))] = (int16_t)(c + 1);
+}
+
 static int parse_currency(const char *s) {
-    for (int i = 0; i < CUR_COUNT; i++) {
-        if (strcmp(s, CUR_NAMES[i]) == 0) return i;
+    int k = cur_key(s);
+    return k < 0 ? -1 : g_curByCode[k] - 1;
+}
+
+/* new accounts hold ACC_OPEN_CURRENCIES at zero */
+static void acct_open_balances(Account *a) {
+    a->balCount = 0;
+    for (size_t i = 0; i < sizeof(ACC_OPEN_CURRENCIES) / sizeof(ACC_OPEN_CURRENCIES[0]); i++)
+        acct_slot(a, parse_currency(ACC_OPEN_CURRENCIES[i]));
+}
+
+static int acct_opens_with(int cur) {
+    for (size_t i = 0; i < sizeof(ACC_OPEN_CURRENCIES) / sizeof(ACC_OPEN_CURRENCIES[0]); i++)
+        if (cur == parse_currency(ACC_OPEN_CURRENCIES[i])) return 1;
+    return 0;
+}
+
+/* Give back the slots of currencies run down to zero, bar the opening
+ * ones, so an account that has cycled through many currencies can still
+ * take up new ones; the rest keep their order. Inside a write section, or
+ * during replay. */
+static void acct_drop_empty(Account *a) {
+    int n = 0;
+    for (int k = 0; k < a->balCount; k++) {
+        if (a->bal[k].minor == 0 && !acct_opens_with(a->bal[k].cur)) continue;
+        a->bal[n++] = a->bal[k];
     }
-    return -1;
+    a->balCount = n;
 }
 
 static void trim_newline(char *s) {
@@ -121,20 +714,623 @@ static void trim_newline(char *s) {
     }
 }
 
+/* --------- money ---------- */
+static const int64_t POW10[] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL
+};
+
+/* round the truncated magnitude v up or not, given the first dropped digit
+ * d and whether anything nonzero follows it */
+static uint64_t round_digit(uint64_t v, int d, int rest, RoundMode mode) {
+    switch (mode) {
+    case ROUND_DOWN:    return v;
+    case ROUND_HALF_UP: return v + (d >= 5);
+    default:            return v + (d > 5 || (d == 5 && (rest || (v & 1))));
+    }
+}
+
+/* Parse a decimal ("12", "0.5", "-3.25", "1.5e+03") into units of
+ * 10^-digits, rounding anything finer. Returns -1 if malformed or beyond
+ * MONEY_MAX. */
+static int money_parse(const char *s, int digits, RoundMode mode, int64_t *out) {
+    char dig[40];
+    int n = 0, intDigits = 0, seen = 0, point = 0, rest = 0;
+    int neg = (*s == '-');
+    if (*s == '-' || *s == '+') s++;
+    for (;; s++) {
+        if (*s >= '0' && *s <= '9') {
+            seen = 1;
+            if (n == 0 && *s == '0' && !point) continue;   /* leading zero */
+            if (n < (int)sizeof(dig)) dig[n++] = *s;
+            else if (*s != '0') rest = 1;
+            if (!point) intDigits++;
+        } else if (*s == '.' && !point) {
+            point = 1;
+        } else {
+            break;
+        }
+    }
+    if (!seen) return -1;
+    if (*s == 'e' || *s == 'E') {
+        char *end;
+        long e = strtol(s + 1, &end, 10);
+        if (end == s + 1 || e < -100 || e > 100) return -1;
+        intDigits += (int)e;
+        s = end;
+    }
+    if (*s != '\0') return -1;
+
+    /* dig holds 0.ddd * 10^intDigits; keep the first intDigits + digits */
+    int keep = intDigits + digits;
+    if (keep > 19) return -1;
+    uint64_t v = 0;
+    for (int i = 0; i < keep; i++) v = v * 10 + (i < n ? dig[i] - '0' : 0);
+    int d = (keep >= 0 && keep < n) ? dig[keep] - '0' : 0;
+    for (int i = keep < 0 ? 0 : keep + 1; i < n && !rest; i++) rest = (dig[i] != '0');
+    v = round_digit(v, d, rest, mode);
+    if (v > (uint64_t)MONEY_MAX) return -1;
+    *out = neg ? -(int64_t)v : (int64_t)v;
+    return 0;
+}
+
+/* Parse an amount typed by a client: [+-]digits[.digits], with no more than
+ * `digits` decimals, straight into minor units in one pass. Unlike
+ * money_parse nothing is rounded and there is no exponent, so "1e308",
+ * "nan" and "0.001" dollars are refused. Returns -1 if malformed or beyond
+ * MONEY_MAX, -2 if it has too many decimals. */
+static int amount_parse(const char *s, int digits, int64_t *out) {
+    int neg = (*s == '-');
+    if (*s == '-' || *s == '+') s++;
+    if (*s < '0' || *s > '9') return -1;
+
+    uint64_t v = 0;
+    int places = 0, point = 0;
+    for (;; s++) {
+        if (*s >= '0' && *s <= '9') {
+            if (point && ++places > digits) continue;
+            v = v * 10 + (uint64_t)(*s - '0');
+            if (v > (uint64_t)MONEY_MAX) return -1;
+        } else if (*s == '.' && !point) {
+            point = 1;
+            if (s[1] < '0' || s[1] > '9') return -1;
+        } else {
+            break;
+        }
+    }
+    if (*s != '\0') return -1;
+    if (places > digits) return -2;
+
+    int64_t scale = POW10[digits - places];
+    if (v > (uint64_t)(MONEY_MAX / scale)) return -1;
+    v *= (uint64_t)scale;
+    *out = neg ? -(int64_t)v : (int64_t)v;
+    return 0;
+}
+
+/* write v as a decimal with `digits` fractional digits into out
+ * (MONEY_STR bytes); returns out */
+static char *fmt_fixed(char *out, int64_t v, int digits) {
+    char tmp[MONEY_STR];
+    char *p = tmp + sizeof(tmp);
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    *--p = '\0';
+    for (int i = 0; i < digits; i++) {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    }
+    if (digits > 0) *--p = '.';
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--p = '-';
+    memcpy(out, p, (size_t)(tmp + sizeof(tmp) - p));
+    return out;
+}
+
+static char *fmt_money(char *out, int64_t v, int cur) {
+    return fmt_fixed(out, v, CUR_DIGITS(cur));
+}
+
+/* amount of FROM (minor units, > 0) at `rate` in TO minor units; -1 beyond
+ * MONEY_MAX */
+static int64_t money_convert(int64_t amount, int from, int to, int64_t rate) {
+    unsigned __int128 num = (unsigned __int128)amount * (uint64_t)rate;
+    uint64_t scale = (uint64_t)POW10[CUR_DIGITS(to)];
+    if (num > ~(unsigned __int128)0 / scale) return -1;
+    num *= scale;
+    uint64_t den = (uint64_t)RATE_SCALE * (uint64_t)POW10[CUR_DIGITS(from)];
+    unsigned __int128 q = num / den, r = num % den;
+    switch (g_cfg.rounding) {
+    case ROUND_DOWN:    break;
+    case ROUND_HALF_UP: q += (2 * r >= den); break;
+    default:            q += (2 * r > den || (2 * r == den && (q & 1))); break;
+    }
+    return q > (unsigned __int128)MONEY_MAX ? -1 : (int64_t)q;
+}
+
+/* --------- exchange rates ---------- */
+/* quotes against one base currency (which is among them at 1), in the
+ * order they were given */
+typedef struct {
+    int base;
+    int count;
+    int16_t cur[CUR_MAX];
+    int64_t quote[CUR_MAX];  /* units of cur[i] per unit of base, RATE_SCALE */
+} Quotes;
+
+static void quotes_set(Quotes *q, int cur, int64_t quote) {
+    int i = 0;
+    while (i < q->count && q->cur[i] != cur) i++;
+    if (i == q->count) q->cur[q->count++] = (int16_t)cur;
+    q->quote[i] = quote;
+}
+
+/* the FROM -> TO cross rate of quotes f and to, rounded half up; -1 when
+ * it rounds to 0 or does not fit an int64_t */
+static int64_t quotes_cross(const Quotes *q, int f, int to) {
+    unsigned __int128 num = (unsigned __int128)q->quote[to] * RATE_SCALE;
+    uint64_t den = (uint64_t)q->quote[f];
+    unsigned __int128 rate = (num + den / 2) / den;
+    return (rate == 0 || rate > INT64_MAX) ? -1 : (int64_t)rate;
+}
+
+/* can every pair of q be exchanged? If not, returns -1 with the first pair
+ * that can't in *from and *to, and q must not be published */
+static int quotes_check(const Quotes *q, int *from, int *to) {
+    for (int f = 0; f < q->count; f++) {
+        for (int t = 0; t < q->count; t++) {
+            if (quotes_cross(q, f, t) == -1) {
+                *from = q->cur[f];
+                *to = q->cur[t];
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static size_t rate_table_size(int count) {
+    return sizeof(RateTable) + (size_t)count * count * sizeof(int64_t);
+}
+
+/* Fill the spare table from q, which passed quotes_check, swap it in, then
+ * wait until no reader can still hold the old one, which becomes the next
+ * spare. Exchanges never wait for this. */
+static void rates_publish(const Quotes *q) {
+    if (pshared_lock(&g_store->rateLock)) {
+        /* a publisher died: if it had already swapped its table in, the
+           spare is live and the old table unknown, so start a fresh spare */
+        if (g_store->rateSpare == atomic_load(&g_store->rates)) {
+            g_store->rateSpare = arena_alloc(rate_table_size(CUR_MAX));
+            if (g_store->rateSpare == NULL) errMsg("rates: store arena full");
+        }
+    }
+    RateTable *t = g_store->rateSpare;
+    RateTable *old = atomic_load(&g_store->rates);
+    t->version = old ? old->version + 1 : 1;
+    t->count = q->count;
+    t->base = q->base;
+    memset(t->pos, 0xff, sizeof(t->pos));
+    for (int i = 0; i < q->count; i++) {
+        t->cur[i] = q->cur[i];
+        t->pos[q->cur[i]] = (int16_t)i;
+    }
+    for (int f = 0; f < q->count; f++)
+        for (int to = 0; to < q->count; to++)
+            t->rate[f * q->count + to] = quotes_cross(q, f, to);
+    atomic_store_explicit(&g_store->rates, t, memory_order_release);
+    if (old) {
+        epoch_synchronize();
+        g_store->rateSpare = old;
+    } else {
+        g_store->rateSpare = arena_alloc(rate_table_size(CUR_MAX));
+        if (g_store->rateSpare == NULL) errMsg("rates: store arena full");
+    }
+    pthread_mutex_unlock(&g_store->rateLock);
+}
+
+/* the current FROM -> TO rate and the version of the table it came from;
+ * -1 if either currency has no quote */
+static int64_t rate_lookup(int from, int to, uint64_t *version) {
+    int ep = epoch_enter();
+    const RateTable *t = atomic_load_explicit(&g_store->rates, memory_order_acquire);
+    int f = t->pos[from], r = t->pos[to];
+    int64_t rate = (f < 0 || r < 0) ? -1 : t->rate[f * t->count + r];
+    if (version) *version = t->version;
+    epoch_exit(ep);
+    return rate;
+}
+
+/* --rates FILE: "base <CUR>" and one "<CUR> <units per base unit>" line per
+ * currency to quote; blank lines and '#' comments are ignored */
+static void rates_load(const char *path, Quotes *q) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) errMsg(path);
+
+    char line[256];
+    int lineNo = 0;
+    q->base = -1;
+    q->count = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNo++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char key[16], val[64];
+        int n = sscanf(line, "%15s %63s", key, val);
+        if (n <= 0) continue;
+        int cur = parse_currency(n == 2 && strcmp(key, "base") == 0 ? val : key);
+        if (n != 2 || cur < 0) {
+            fprintf(stderr, "%s:%d: expected \"base <CUR>\" or \"<CUR> <rate>\"\n",
+                    path, lineNo);
+            exit(EXIT_FAILURE);
+        }
+        int64_t quote = RATE_SCALE;
+        if (strcmp(key, "base") == 0) {
+            q->base = cur;
+        } else if (money_parse(val, RATE_DIGITS, ROUND_HALF_EVEN, &quote) == -1 || quote <= 0) {
+            fprintf(stderr, "%s:%d: bad rate \"%s\"\n", path, lineNo, val);
+            exit(EXIT_FAILURE);
+        }
+        quotes_set(q, cur, quote);
+    }
+    fclose(fp);
+
+    if (q->base < 0) {
+        fprintf(stderr, "%s: no \"base <CUR>\" line\n", path);
+        exit(EXIT_FAILURE);
+    }
+    quotes_set(q, q->base, RATE_SCALE);
+    int from, to;
+    if (quotes_check(q, &from, &to) == -1) {
+        fprintf(stderr, "%s: the %s -> %s cross rate is out of range\n",
+                path, CUR_CODE(from), CUR_CODE(to));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* startup: publish the --rates file or the built-in quotes */
+static void rates_create(void) {
+    Quotes q;
+    if (g_cfg.ratesFile) {
+        rates_load(g_cfg.ratesFile, &q);
+    } else {
+        q.base = parse_currency(DEFAULT_RATE_BASE);
+        q.count = 0;
+        for (size_t i = 0; i < sizeof(DEFAULT_QUOTES) / sizeof(DEFAULT_QUOTES[0]); i++)
+            quotes_set(&q, parse_currency(DEFAULT_QUOTES[i].code), DEFAULT_QUOTES[i].quote);
+    }
+
+    g_store->rateSpare = arena_alloc(rate_table_size(CUR_MAX));
+    if (g_store->rateSpare == NULL) errMsg("rates: store arena full");
+    rates_publish(&q);
+}
+
+/* --------- rate feed ---------- */
+/* --rate-feed PATH: a publisher connects to this UNIX stream socket and
+ * writes lines of "<CUR> <rate> [<CUR> <rate> ...]", quoted against the
+ * current base; a currency not quoted before is added. Each line becomes
+ * one new table, built and published from this thread; a bad line, or one
+ * that would put a cross rate out of range, is reported and skipped. */
+static void rate_feed_line(char *line, Quotes *q) {
+    Quotes next = *q;
+    int n = 0;
+    char *save;
+    for (char *key = strtok_r(line, " \t\r\n", &save); key;
+         key = strtok_r(NULL, " \t\r\n", &save)) {
+        char *val = strtok_r(NULL, " \t\r\n", &save);
+        int cur = parse_currency(key);
+        int64_t quote;
+        if (val == NULL || cur < 0 || cur == q->base ||
+            money_parse(val, RATE_DIGITS, ROUND_HALF_EVEN, &quote) == -1 || quote <= 0) {
+            fprintf(stderr, "rate feed: bad quote \"%s %s\", line ignored\n",
+                    key, val ? val : "");
+            return;
+        }
+        quotes_set(&next, cur, quote);
+        n++;
+    }
+    if (n == 0) return;
+    int from, to;
+    if (quotes_check(&next, &from, &to) == -1) {
+        fprintf(stderr, "rate feed: the %s -> %s cross rate is out of range, line ignored\n",
+                CUR_CODE(from), CUR_CODE(to));
+        return;
+    }
+    *q = next;
+    rates_publish(q);
+}
+
+static void *rate_feed_main(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+
+    /* this thread is the only publisher, so the table can't be recycled here */
+    const RateTable *t = atomic_load(&g_store->rates);
+    Quotes q;
+    q.base = t->base;
+    q.count = t->count;
+    for (int i = 0; i < t->count; i++) {
+        q.cur[i] = t->cur[i];
+        q.quote[i] = t->rate[t->pos[t->base] * t->count + i];
+    }
+
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR) perror("rate feed accept");
+            continue;
+        }
+        FILE *fp = fdopen(fd, "r");
+        if (!fp) {
+            close(fd);
+            continue;
+        }
+        char line[1024];
+        while (fgets(line, sizeof(line), fp)) rate_feed_line(line, &q);
+        fclose(fp);
+    }
+    return NULL;
+}
+
+static void rate_feed_start(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: rate feed path too long\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    /* a socket left behind by an earlier run; anything else is not ours */
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd == -1) errMsg("rate feed socket");
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) errMsg(path);
+    if (listen(lfd, 4) == -1) errMsg("rate feed listen");
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, rate_feed_main, (void *)(intptr_t)lfd) != 0)
+        errMsg("pthread_create");
+    pthread_detach(th);
+}
+
+/* --------- indexes ---------- */
+/* FNV-1a */
+static uint32_t hash_str(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void hash_insert(HashIndex *t, uint32_t h, int idx) {
+    uint32_t mask = t->slots - 1;
+    uint32_t i = h & mask;
+    while (atomic_load_explicit(&t->slot[i].ref, memory_order_relaxed) != 0) i = (i + 1) & mask;
+    t->slot[i].hash = h;
+    atomic_store_explicit(&t->slot[i].ref, idx + 1, memory_order_release);
+}
+
+/* make room for one more key at most half full, doubling and rehashing the
+ * table as needed; -1 when the arena is exhausted */
+static size_t hash_bytes(uint32_t slots) {
+    return sizeof(HashIndex) + (size_t)slots * sizeof(HashSlot);
+}
+
+static int hash_reserve(_Atomic(HashIndex *) *tab, int count) {
+    HashIndex *old = atomic_load(tab);
+    if (old && (uint64_t)(count + 1) * 2 <= old->slots) return 0;
+
+    uint32_t n = old ? old->slots * 2 : HASH_MIN_SLOTS;
+    HashIndex *t = arena_alloc(hash_bytes(n));
+    if (!t) return -1;
+    t->slots = n;
+    for (uint32_t i = 0; old && i < old->slots; i++) {
+        int ref = atomic_load_explicit(&old->slot[i].ref, memory_order_relaxed);
+        if (ref != 0) hash_insert(t, old->slot[i].hash, ref - 1);
+    }
+    atomic_store(tab, t);
+    if (old) {
+        epoch_synchronize();
+        arena_release(old, hash_bytes(old->slots));
+    }
+    return 0;
+}
+
+/* lookups take no lock: callers may race with inserts and index growth */
 static int user_index(DB *db, const char *username) {
-    for (int i = 0; i < db->userCount; i++) {
-        if (strcmp(db->users[i].username, username) == 0) return i;
+    uint32_t h = hash_str(username);
+    int found = -1, ref;
+    int ep = epoch_enter();
+    HashIndex *t = atomic_load(&db->userHash);
+    uint32_t mask = t ? t->slots - 1 : 0;
+    for (uint32_t i = h & mask;
+         t && (ref = atomic_load_explicit(&t->slot[i].ref, memory_order_acquire)) != 0;
+         i = (i + 1) & mask) {
+        if (t->slot[i].hash == h && strcmp(db_user(db, ref - 1)->username, username) == 0) {
+            found = ref - 1;
+            break;
+        }
     }
-    return -1;
+    epoch_exit(ep);
+    return found;
 }
 
 static int account_index(DB *db, const char *accid) {
-    for (int i = 0; i < db->accCount; i++) {
-        if (strcmp(db->accounts[i].id, accid) == 0) return i;
+    uint32_t h = hash_str(accid);
+    int found = -1, ref;
+    int ep = epoch_enter();
+    HashIndex *t = atomic_load(&db->accHash);
+    uint32_t mask = t ? t->slots - 1 : 0;
+    for (uint32_t i = h & mask;
+         t && (ref = atomic_load_explicit(&t->slot[i].ref, memory_order_acquire)) != 0;
+         i = (i + 1) & mask) {
+        if (t->slot[i].hash == h && strcmp(db_account(db, ref - 1)->id, accid) == 0) {
+            found = ref - 1;
+            break;
+        }
+    }
+    epoch_exit(ep);
+    return found;
+}
+
+static void bin_pack_user(const User *u, BinRecord *r, long long lsn) {
+    memset(r, 0, sizeof(*r));
+    r->tag = BIN_USER;
+    r->lsn = lsn;
+    memcpy(r->name, u->username, USERNAME_LEN);
+    memcpy(r->u.password, u->password, PASS_LEN);
+}
+
+static void bin_pack_account(const Account *a, BinRecord *r, long long lsn) {
+    memset(r, 0, sizeof(*r));
+    r->tag = BIN_ACC;
+    r->isJoint = (uint32_t)a->isJoint;
+    r->lsn = lsn;
+    memcpy(r->name, a->id, ACCID_LEN);
+    r->ownerCount = a->ownerCount;
+    r->balCount = a->balCount;
+    for (int k = 0; k < a->balCount; k++) {
+        memcpy(r->bal[k].code, CUR_CODE(a->bal[k].cur), sizeof(r->bal[k].code));
+        r->bal[k].minor = a->bal[k].minor;
+    }
+    memcpy(r->u.owners, a->owners, sizeof(r->u.owners));
+}
+
+/* With --persist mmap, BIN_FILE itself is mapped shared and every change is
+ * copied straight into its record; the thread remembers the bytes it
+ * dirtied and store_commit() msyncs exactly that range. The mapping is a
+ * write-through copy: the records commands read and lock are still the
+ * ones in the store, loaded from the file at startup like --format binary
+ * (their layout, with seqlocks and index links, is not the file's). */
+static void bin_map_record(int slot, const BinRecord *r) {
+    off_t end = bin_offset(slot) + BIN_REC_SIZE;
+    if (end > g_store->binSize) {
+        /* new record past EOF (creations only, under the store write lock) */
+        off_t size = end + (off_t)BIN_GROW * BIN_REC_SIZE;
+        if ((size_t)size > g_store->binMapSize) errMsg("mmap store: " BIN_FILE " full");
+        if (ftruncate(g_binfd, size) == -1) errMsg("ftruncate " BIN_FILE);
+        g_store->binSize = size;
+    }
+
+    char *p = g_binmap + bin_offset(slot);
+    memcpy(p, r, BIN_REC_SIZE);
+    if (!t_dirtyLo || p < t_dirtyLo) t_dirtyLo = p;
+    if (p + BIN_REC_SIZE > t_dirtyHi) t_dirtyHi = p + BIN_REC_SIZE;
+}
+
+static void bin_map_sync(void) {
+    if (!t_dirtyLo) return;
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    char *lo = (char *)((uintptr_t)t_dirtyLo & ~(page - 1));
+    if (msync(lo, (size_t)(t_dirtyHi - lo), MS_SYNC) == -1) errMsg("msync " BIN_FILE);
+    t_dirtyLo = t_dirtyHi = NULL;
+}
+
+/* Record a change for persistence: written through to the mapping with
+ * --persist mmap, otherwise queued for the next binary flush (lock-free,
+ * each record is queued at most once until the flush takes the list).
+ * Caller holds the lock that serialises writers of the record. */
+static void db_touch_user(DB *db, int idx) {
+    User *u = db_user(db, idx);
+    if (g_binmap) {
+        BinRecord r;
+        bin_pack_user(u, &r, 0);
+        bin_map_record(u->slot, &r);
+        return;
+    }
+    if (!db->trackDirty || atomic_exchange(&u->dirty, 1)) return;
+    int head = atomic_load(&db->dirtyUsers);
+    do u->dirtyNext = head;
+    while (!atomic_compare_exchange_weak(&db->dirtyUsers, &head, idx));
+}
+
+static void db_touch_account(DB *db, int idx) {
+    Account *a = db_account(db, idx);
+    if (g_binmap) {
+        BinRecord r;
+        bin_pack_account(a, &r, 0);
+        bin_map_record(a->slot, &r);
+        return;
+    }
+    if (!db->trackDirty || atomic_exchange(&a->dirty, 1)) return;
+    int head = atomic_load(&db->dirtyAccs);
+    do a->dirtyNext = head;
+    while (!atomic_compare_exchange_weak(&db->dirtyAccs, &head, idx));
+}
+
+/* append a user and index it; caller checked uniqueness.
+ * Returns -1 when the store is out of space. */
+static int db_add_user(DB *db, const char *username, const char *password) {
+    int idx = db->userCount;
+    if (idx / USER_CHUNK >= MAX_CHUNKS) return -1;
+    User **chunk = &db->userChunks[idx / USER_CHUNK];
+    if (hash_reserve(&db->userHash, idx) == -1) return -1;
+    if (!*chunk && !(*chunk = arena_alloc(USER_CHUNK * sizeof(User)))) return -1;
+
+    db->userCount++;
+    User *u = db_user(db, idx);
+    memset(u, 0, sizeof(*u));
+    strncpy(u->username, username, USERNAME_LEN - 1);
+    strncpy(u->password, password, PASS_LEN - 1);
+    u->ownedHead = u->ownedTail = -1;
+    u->slot = db->slotCount++;
+    db_touch_user(db, idx);
+    hash_insert(atomic_load(&db->userHash), hash_str(u->username), idx);
+    return 0;
+}
+
+/* position of user uidx among a's owners, or -1 */
+static int owner_slot(const Account *a, int uidx) {
+    for (int k = 0; k < a->ownerCount; k++) {
+        if (a->ownerIdx[k] == uidx) return k;
     }
     return -1;
 }
 
+/* append an account (id, type, owners filled in), index it and link it
+ * into each owner's list; caller checked uniqueness.
+ * Returns -1 when the store is out of space. */
+static int db_add_account(DB *db, const Account *src) {
+    int idx = db->accCount;
+    if (idx / ACC_CHUNK >= MAX_CHUNKS) return -1;
+    Account **chunk = &db->accChunks[idx / ACC_CHUNK];
+    if (hash_reserve(&db->accHash, idx) == -1) return -1;
+    if (!*chunk && !(*chunk = arena_alloc(ACC_CHUNK * sizeof(Account)))) return -1;
+
+    db->accCount++;
+    Account *a = db_account(db, idx);
+    *a = *src;
+    a->slot = db->slotCount++;
+    a->dirty = 0;
+    db_touch_account(db, idx);
+
+    for (int k = 0; k < a->ownerCount; k++) {
+        int uidx = user_index(db, a->owners[k]);
+        a->ownerIdx[k] = uidx;
+        a->ownedNext[k] = -1;
+        if (uidx == -1 || owner_slot(a, uidx) != k) continue;  /* unknown or repeated */
+
+        User *u = db_user(db, uidx);
+        if (u->ownedTail == -1) {
+            u->ownedHead = idx;
+        } else {
+            Account *tail = db_account(db, u->ownedTail);
+            tail->ownedNext[owner_slot(tail, uidx)] = idx;
+        }
+        u->ownedTail = idx;
+    }
+
+    hash_insert(atomic_load(&db->accHash), hash_str(a->id), idx);
+    return 0;
+}
+
 static int is_owner(Account *a, const char *username) {
     for (int i = 0; i < a->ownerCount; i++) {
         if (strcmp(a->owners[i], username) == 0) return 1;
@@ -143,10 +1339,15 @@ static int is_owner(Account *a, const char *username) {
 }
 
 static int gen_account_id(DB *db, char *out, size_t outsz) {
-    /* simple ID: ACC<number> ; ensure uniqueness */
+    /* random ID: ACC<number>, with at least four digits and more as the
+       book grows, so that no more than a tenth of the id space is taken */
+    long long lo = 1000, span = 9000;
+    while (span < 10LL * (db->accCount + 1)) { lo *= 10; span *= 10; }
+
     for (int tries = 0; tries < 10000; tries++) {
-        int n = 1000 + (rand() % 9000);
-        snprintf(out, outsz, "ACC%d", n);
+        long long r = ((long long)rand() << 31) ^ rand();
+        long long n = lo + r % span;
+        snprintf(out, outsz, "ACC%lld", n);
         if (account_index(db, out) == -1) return 0;
     }
     return -1;
@@ -155,10 +1356,29 @@ static int gen_account_id(DB *db, char *out, size_t outsz) {
 /* --------- DB load/save ---------- */
 static void db_init(DB *db) {
     memset(db, 0, sizeof(*db));
+    db->dirtyUsers = db->dirtyAccs = -1;
+}
+
+/* fill a->owners from "owner1,owner2,..."; returns the number stored */
+static int split_owners(Account *a, const char *ownersCSV, int maxOwners) {
+    int idx = 0;
+    char tmp[256];
+    strncpy(tmp, ownersCSV, sizeof(tmp));
+    tmp[sizeof(tmp)-1] = '\0';
+
+    char *save = NULL;
+    char *tok = strtok_r(tmp, ",", &save);
+    while (tok && idx < maxOwners) {
+        strncpy(a->owners[idx], tok, USERNAME_LEN);
+        a->owners[idx][USERNAME_LEN-1] = '\0';
+        idx++;
+        tok = strtok_r(NULL, ",", &save);
+    }
+    a->ownerCount = idx;
+    return idx;
 }
 
-static void db_load_locked(int fd, DB *db) {
-    /* fd is locked already (read or write) */
+static void db_load(int fd, DB *db) {
     db_init(db);
 
     lseek(fd, 0, SEEK_SET);
@@ -170,55 +1390,52 @@ static void db_load_locked(int fd, DB *db) {
         trim_newline(line);
         if (line[0] == '\0') continue;
 
-        if (strncmp(line, "USER ", 5) == 0) {
-            if (db->userCount >= MAX_USERS) continue;
-
+        if (strncmp(line, "LSN ", 4) == 0) {
+            sscanf(line, "LSN %lld", &db->lsn);
+        } else if (strncmp(line, "USER ", 5) == 0) {
             char u[USERNAME_LEN], p[PASS_LEN];
-            if (sscanf(line, "USER %31s %31s", u, p) == 2) {
-                strncpy(db->users[db->userCount].username, u, USERNAME_LEN);
-                strncpy(db->users[db->userCount].password, p, PASS_LEN);
-                db->userCount++;
-            }
+            if (sscanf(line, "USER %31s %31s", u, p) == 2 && user_index(db, u) == -1)
+                if (db_add_user(db, u, p) == -1) errMsg("db_load: store arena full");
         } else if (strncmp(line, "ACC ", 4) == 0) {
-            if (db->accCount >= MAX_ACCOUNTS) continue;
-
             /* format:
-               ACC <id> <type> <ownerCount> <owner1,owner2,...> <balUSD> <balEUR> <balGBP>
+               ACC <id> <type> <ownerCount> <owner1,owner2,...> <CUR>=<amount> ...
+               (older files: <balUSD> <balEUR> <balGBP>)
              */
             char id[ACCID_LEN], type[16], ownersCSV[256];
-            int ownerCount = 0;
-            double b0, b1, b2;
-
-            if (sscanf(line, "ACC %31s %15s %d %255s %lf %lf %lf",
-                       id, type, &ownerCount, ownersCSV, &b0, &b1, &b2) == 7) {
-
-                Account *a = &db->accounts[db->accCount];
-                memset(a, 0, sizeof(*a));
-                strncpy(a->id, id, ACCID_LEN);
-                a->isJoint = (strcmp(type, "JOINT") == 0) ? 1 : 0;
-                a->ownerCount = ownerCount;
-                if (a->ownerCount > MAX_OWNERS) a->ownerCount = MAX_OWNERS;
-
-                /* split ownersCSV by comma */
-                int idx = 0;
-                char tmp[256];
-                strncpy(tmp, ownersCSV, sizeof(tmp));
-                tmp[sizeof(tmp)-1] = '\0';
-
-                char *tok = strtok(tmp, ",");
-                while (tok && idx < a->ownerCount) {
-                    strncpy(a->owners[idx], tok, USERNAME_LEN);
-                    a->owners[idx][USERNAME_LEN-1] = '\0';
-                    idx++;
-                    tok = strtok(NULL, ",");
+            int ownerCount = 0, n = 0;
+
+            if (sscanf(line, "ACC %31s %15s %d %255s %n",
+                       id, type, &ownerCount, ownersCSV, &n) == 4 && n > 0 &&
+                account_index(db, id) == -1) {
+
+                Account a;
+                memset(&a, 0, sizeof(a));
+                strncpy(a.id, id, ACCID_LEN);
+                a.isJoint = (strcmp(type, "JOINT") == 0) ? 1 : 0;
+                if (ownerCount > MAX_OWNERS) ownerCount = MAX_OWNERS;
+                split_owners(&a, ownersCSV, ownerCount);
+
+                static const char *const legacy[] = { "USD", "EUR", "GBP" };
+                char *save;
+                int pos = 0;
+                for (char *tok = strtok_r(line + n, " ", &save); tok;
+                     tok = strtok_r(NULL, " ", &save), pos++) {
+                    char *eq = strchr(tok, '=');
+                    int cur = -1;
+                    if (eq) {
+                        *eq = '\0';
+                        cur = parse_currency(tok);
+                        tok = eq + 1;
+                    } else if (pos < 3) {
+                        cur = parse_currency(legacy[pos]);
+                    }
+                    int k = cur < 0 ? -1 : acct_slot(&a, cur);
+                    if (k != -1 &&
+                        money_parse(tok, CUR_DIGITS(cur), ROUND_HALF_EVEN, &a.bal[k].minor) == -1)
+                        a.bal[k].minor = 0;
                 }
-                a->ownerCount = idx;
 
-                a->bal[CUR_USD] = b0;
-                a->bal[CUR_EUR] = b1;
-                a->bal[CUR_GBP] = b2;
-
-                db->accCount++;
+                if (db_add_account(db, &a) == -1) errMsg("db_load: store arena full");
             }
         }
     }
@@ -226,541 +1443,3147 @@ static void db_load_locked(int fd, DB *db) {
     fclose(fp);
 }
 
-static void db_save_locked(int fd, DB *db) {
-    /* fd is locked for write already */
-    if (ftruncate(fd, 0) == -1) errMsg("ftruncate");
-    lseek(fd, 0, SEEK_SET);
+/* write the snapshot cut c; users and accounts past its counts were
+ * created after the cut and are left out */
+static void db_save(int fd, DB *db, const SnapshotCut *c) {
+    FILE *fp = fdopen(dup(fd), "w");
+    if (!fp) errMsg("fdopen");
+    setvbuf(fp, NULL, _IOFBF, SNAPSHOT_BUF);
+
+    fprintf(fp, "LSN %lld\n", c->lsn);
 
     /* write USERS */
-    for (int i = 0; i < db->userCount; i++) {
-        dprintf(fd, "USER %s %s\n", db->users[i].username, db->users[i].password);
+    for (int i = 0; i < c->userCount; i++) {
+        User *u = db_user(db, i);
+        fprintf(fp, "USER %s %s\n", u->username, u->password);
     }
 
     /* write ACCOUNTS */
-    for (int i = 0; i < db->accCount; i++) {
-        Account *a = &db->accounts[i];
+    const Balance *b = c->bal;
+    for (int i = 0; i < c->accCount; i++) {
+        Account *a = db_account(db, i);
         char ownersCSV[256] = {0};
         for (int k = 0; k < a->ownerCount; k++) {
             strcat(ownersCSV, a->owners[k]);
             if (k < a->ownerCount - 1) strcat(ownersCSV, ",");
         }
-        dprintf(fd, "ACC %s %s %d %s %.2f %.2f %.2f\n",
+        char bal[ACC_CURRENCIES * (MONEY_STR + 5)];
+        size_t len = 0;
+        for (int k = 0; k < c->balCount[i]; k++, b++) {
+            char m[MONEY_STR];
+            len += (size_t)snprintf(bal + len, sizeof(bal) - len, " %s=%s",
+                                    CUR_CODE(b->cur), fmt_money(m, b->minor, b->cur));
+        }
+        bal[len] = '\0';
+        fprintf(fp, "ACC %s %s %d %s%s\n",
                 a->id,
                 a->isJoint ? "JOINT" : "IND",
                 a->ownerCount,
                 ownersCSV[0] ? ownersCSV : "-",
-                a->bal[CUR_USD], a->bal[CUR_EUR], a->bal[CUR_GBP]);
+                bal);
     }
 
-    fsync(fd);
+    if (fflush(fp) == EOF) errMsg("write snapshot");
+    fclose(fp);
+    if (fsync(fd) == -1) errMsg("fsync");
 }
 
-/* --------- protocol helpers ---------- */
-static int send_all(int fd, const char *s) {
-    size_t len = strlen(s);
-    ssize_t w = write(fd, s, len);
-    return (w == (ssize_t)len) ? 0 : -1;
-}
-
-static int recv_line(int fd, char *buf, size_t bufsz) {
-    size_t i = 0;
-    while (i + 1 < bufsz) {
-        char c;
-        ssize_t r = read(fd, &c, 1);
-        if (r == 0) return 0;          /* closed */
-        if (r < 0) {
+/* --------- binary format ---------- */
+static void pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, off);
+        if (w < 0) {
             if (errno == EINTR) continue;
-            return -1;
+            errMsg("pwrite DB");
         }
-        buf[i++] = c;
-        if (c == '\n') break;
+        p += w;
+        off += w;
+        len -= (size_t)w;
     }
-    buf[i] = '\0';
-    return 1;
 }
 
-/* --------- commands ---------- */
-static void cmd_help(int cfd) {
-    send_all(cfd,
-        "OK Commands:\n"
-        "  REGISTER <user> <pass>\n"
-        "  LOGIN <user> <pass>\n"
-        "  RATES\n"
-        "  CREATE_ACCOUNT IND|JOINT <ownersCSV>\n"
-        "  LIST_ACCOUNTS\n"
-        "  BALANCES <accid>\n"
-        "  DEPOSIT <accid> <CUR> <amount>\n"
-        "  WITHDRAW <accid> <CUR> <amount>\n"
-        "  EXCHANGE <accid> <FROMCUR> <TOCUR> <amount>\n"
-        "  QUIT\n"
-        "END\n");
+static void bin_write_header(int fd, long long lsn) {
+    BinHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BIN_MAGIC, sizeof(h.magic));
+    h.recSize = BIN_REC_SIZE;
+    h.lsn = lsn;
+    pwrite_all(fd, &h, sizeof(h), 0);
 }
 
-static void cmd_rates(int cfd) {
-    char out[512];
-    snprintf(out, sizeof(out),
-             "OK Rates (approx, fixed):\n"
-             "  1 EUR = %.2f USD\n"
-             "  1 EUR = %.2f GBP\n"
-             "END\n",
-             rate(CUR_EUR, CUR_USD),
-             rate(CUR_EUR, CUR_GBP));
-    send_all(cfd, out);
+static void bin_write_user(int fd, const User *u, long long lsn) {
+    BinRecord r;
+    bin_pack_user(u, &r, lsn);
+    pwrite_all(fd, &r, sizeof(r), bin_offset(u->slot));
 }
 
-static void cmd_register(int cfd, int dbfd, const char *u, const char *p) {
-    lock_file(dbfd, F_WRLCK);
-
-    DB db;
-    db_load_locked(dbfd, &db);
+static void bin_write_account(int fd, const Account *a, long long lsn) {
+    BinRecord r;
+    bin_pack_account(a, &r, lsn);
+    pwrite_all(fd, &r, sizeof(r), bin_offset(a->slot));
+}
 
-    if (user_index(&db, u) != -1) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR User already exists\nEND\n");
-        return;
+/* load BIN_FILE into db; returns the highest record lsn. *legacy is set
+ * for a version 1 or 2 file (BinRecordV2), which the caller rewrites. */
+static long long bin_load(int fd, DB *db, int *legacy) {
+    db_init(db);
+    *legacy = 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) errMsg("fstat DB");
+    if (st.st_size < BIN_V2_REC_SIZE) return 0;  /* new file */
+
+    const char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) errMsg("mmap DB");
+
+    /* the header fields read here sit at the same offsets in every version */
+    const BinHeader *h = (const BinHeader *)map;
+    int version = (unsigned char)h->magic[7];
+    size_t recSize = version < BIN_VERSION ? BIN_V2_REC_SIZE : BIN_REC_SIZE;
+    if (memcmp(h->magic, BIN_MAGIC, 7) != 0 || version < 1 || version > BIN_VERSION ||
+        h->recSize != recSize || (size_t)st.st_size < recSize) {
+        fprintf(stderr, "%s: not a database file of this version\n", BIN_FILE);
+        exit(EXIT_FAILURE);
     }
-
-    if (db.userCount >= MAX_USERS) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR User limit reached\nEND\n");
-        return;
+    *legacy = (version < BIN_VERSION);
+    db->lsn = h->lsn;
+    long long maxLsn = h->lsn;
+
+    int slots = (int)((size_t)st.st_size / recSize) - 1;  /* a torn last record is ignored */
+    int used = 0;
+    for (int s = 0; s < slots; s++) {
+        /* tag through ownerCount are laid out alike in BinRecordV2 */
+        const BinRecord *r = (const BinRecord *)(map + (s + 1) * recSize);
+        const BinRecordV2 *r2 = (const BinRecordV2 *)r;
+        db->slotCount = s;           /* db_add_* hand out slotCount */
+        if (r->tag == BIN_USER) {
+            char u[USERNAME_LEN], p[PASS_LEN];
+            snprintf(u, sizeof(u), "%.*s", USERNAME_LEN - 1, r->name);
+            snprintf(p, sizeof(p), "%.*s", PASS_LEN - 1,
+                     *legacy ? r2->u.password : r->u.password);
+            if (user_index(db, u) == -1 && db_add_user(db, u, p) == -1)
+                errMsg("bin_load: store arena full");
+        } else if (r->tag == BIN_ACC) {
+            Account a;
+            memset(&a, 0, sizeof(a));
+            snprintf(a.id, sizeof(a.id), "%.*s", ACCID_LEN - 1, r->name);
+            a.isJoint = r->isJoint ? 1 : 0;
+            a.ownerCount = (r->ownerCount < 0 || r->ownerCount > MAX_OWNERS)
+                         ? 0 : r->ownerCount;
+            for (int k = 0; k < a.ownerCount; k++)
+                snprintf(a.owners[k], USERNAME_LEN, "%.*s", USERNAME_LEN - 1,
+                         *legacy ? r2->u.owners[k] : r->u.owners[k]);
+            if (*legacy) {
+                /* USD, EUR, GBP; version 1 held doubles */
+                acct_open_balances(&a);
+                for (int k = 0; k < 3; k++) {
+                    if (version == 2) {
+                        a.bal[k].minor = r2->bal.v2[k];
+                        continue;
+                    }
+                    char txt[MONEY_STR + 16];
+                    snprintf(txt, sizeof(txt), "%.17g", r2->bal.v1[k]);
+                    if (money_parse(txt, CUR_DIGITS(a.bal[k].cur), ROUND_HALF_EVEN,
+                                    &a.bal[k].minor) == -1)
+                        a.bal[k].minor = 0;
+                }
+            } else {
+                int n = (r->balCount < 0 || r->balCount > ACC_CURRENCIES) ? 0 : r->balCount;
+                for (int k = 0; k < n; k++) {
+                    char code[sizeof(r->bal[k].code) + 1];
+                    snprintf(code, sizeof(code), "%.*s",
+                             (int)sizeof(r->bal[k].code), r->bal[k].code);
+                    int cur = parse_currency(code);
+                    if (cur < 0) continue;
+                    int slot = acct_slot(&a, cur);
+                    a.bal[slot].minor = r->bal[k].minor;
+                }
+            }
+            a.fileLsn = r->lsn;
+            if (account_index(db, a.id) == -1 && db_add_account(db, &a) == -1)
+                errMsg("bin_load: store arena full");
+        } else {
+            continue;
+        }
+        if (r->lsn > maxLsn) maxLsn = r->lsn;
+        used = s + 1;
     }
+    db->slotCount = used;            /* free slots at the end get reused */
 
-    strncpy(db.users[db.userCount].username, u, USERNAME_LEN);
-    strncpy(db.users[db.userCount].password, p, PASS_LEN);
-    db.userCount++;
-
-    db_save_locked(dbfd, &db);
-    unlock_file(dbfd);
-
-    send_all(cfd, "OK Registered\nEND\n");
+    munmap((void *)map, (size_t)st.st_size);
+    return maxLsn;
 }
 
-static int cmd_login(int cfd, int dbfd, const char *u, const char *p, char *loggedUser) {
-    lock_file(dbfd, F_RDLCK);
-
-    DB db;
-    db_load_locked(dbfd, &db);
+/* grow an array of *cap elements of size bytes to hold at least n */
+static void *cut_reserve(void *p, size_t *cap, size_t n, size_t size) {
+    if (n <= *cap) return p;
+    size_t want = *cap ? *cap : 1024;
+    while (want < n) want *= 2;
+    p = realloc(p, want * size);
+    if (!p) errMsg("realloc");
+    *cap = want;
+    return p;
+}
 
-    int idx = user_index(&db, u);
-    if (idx == -1) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR No such user\nEND\n");
-        return 0;
+/* pack the records queued since the last flush into c; caller holds the
+ * store write lock */
+static void bin_cut(DB *db, SnapshotCut *c) {
+    c->recCount = 0;
+    for (int i = atomic_exchange(&db->dirtyUsers, -1); i != -1; ) {
+        User *u = db_user(db, i);
+        i = u->dirtyNext;
+        u->dirty = 0;
+        c->recs = cut_reserve(c->recs, &c->recCap, c->recCount + 1, sizeof(*c->recs));
+        c->recs[c->recCount].slot = u->slot;
+        bin_pack_user(u, &c->recs[c->recCount++].r, c->lsn);
     }
-    if (strcmp(db.users[idx].password, p) != 0) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR Wrong password\nEND\n");
-        return 0;
+    for (int i = atomic_exchange(&db->dirtyAccs, -1); i != -1; ) {
+        Account *a = db_account(db, i);
+        i = a->dirtyNext;
+        a->dirty = 0;
+        a->fileLsn = c->lsn;
+        c->recs = cut_reserve(c->recs, &c->recCap, c->recCount + 1, sizeof(*c->recs));
+        c->recs[c->recCount].slot = a->slot;
+        bin_pack_account(a, &c->recs[c->recCount++].r, c->lsn);
     }
+}
 
-    unlock_file(dbfd);
-    strncpy(loggedUser, u, USERNAME_LEN);
-    send_all(cfd, "OK Logged in\nEND\n");
-    return 1;
+/* write the records of c in place, then the header */
+static void bin_flush(const SnapshotCut *c) {
+    for (size_t i = 0; i < c->recCount; i++)
+        pwrite_all(g_binfd, &c->recs[i].r, sizeof(BinRecord), bin_offset(c->recs[i].slot));
+    if (fdatasync(g_binfd) == -1) errMsg("fdatasync DB");
+    bin_write_header(g_binfd, c->lsn);
+    if (fdatasync(g_binfd) == -1) errMsg("fdatasync DB");
 }
 
-static void cmd_create_account(int cfd, int dbfd, const char *loggedUser,
-                               const char *type, const char *ownersCSV) {
-    if (loggedUser[0] == '\0') {
-        send_all(cfd, "ERR Please LOGIN first\nEND\n");
-        return;
+/* write every record to a fresh file; accounts ahead of db->lsn keep their lsn */
+static void bin_save(int fd, DB *db) {
+    for (int i = 0; i < db->userCount; i++) bin_write_user(fd, db_user(db, i), db->lsn);
+    for (int i = 0; i < db->accCount; i++) {
+        Account *a = db_account(db, i);
+        bin_write_account(fd, a, a->fileLsn > db->lsn ? a->fileLsn : db->lsn);
     }
+    bin_write_header(fd, db->lsn);
+    if (fsync(fd) == -1) errMsg("fsync");
+}
 
-    int isJoint = 0;
-    if (strcmp(type, "IND") == 0) isJoint = 0;
-    else if (strcmp(type, "JOINT") == 0) isJoint = 1;
-    else {
-        send_all(cfd, "ERR type must be IND or JOINT\nEND\n");
-        return;
+/* --------- snapshots ---------- */
+static void fsync_dir(void) {
+    int dirfd = open(".", O_RDONLY);
+    if (dirfd != -1) {
+        fsync(dirfd);
+        close(dirfd);
     }
+}
 
-    lock_file(dbfd, F_WRLCK);
-
-    DB db;
-    db_load_locked(dbfd, &db);
-
-    if (db.accCount >= MAX_ACCOUNTS) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR Account limit reached\nEND\n");
+/* copy out what the snapshot at db->lsn needs; caller holds the store
+ * write lock */
+static void snapshot_cut(DB *db, SnapshotCut *c) {
+    c->lsn = db->lsn;
+    c->userCount = db->userCount;
+    c->accCount = db->accCount;
+    if (g_cfg.format == FORMAT_BINARY) {
+        bin_cut(db, c);
         return;
     }
 
-    Account a;
-    memset(&a, 0, sizeof(a));
-    a.isJoint = isJoint;
+    c->balCount = cut_reserve(c->balCount, &c->accCap, (size_t)c->accCount, sizeof(int));
+    size_t n = 0;
+    for (int i = 0; i < c->accCount; i++) {
+        Account *a = db_account(db, i);
+        c->bal = cut_reserve(c->bal, &c->balCap, n + (size_t)a->balCount, sizeof(Balance));
+        memcpy(c->bal + n, a->bal, (size_t)a->balCount * sizeof(Balance));
+        c->balCount[i] = a->balCount;
+        n += (size_t)a->balCount;
+    }
+}
 
-    if (gen_account_id(&db, a.id, sizeof(a.id)) == -1) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR Could not generate account id\nEND\n");
+/* Bring the snapshot up to the cut; needs no lock.
+ * Text: write a full snapshot next to DB_FILE and rename it into place, so
+ * a crash leaves either the old or the new file, never a truncated one.
+ * Binary: rewrite just the records that changed. */
+static void snapshot_save(DB *db, const SnapshotCut *c) {
+    if (g_cfg.format == FORMAT_BINARY) {
+        bin_flush(c);
         return;
     }
 
-    /* parse owners */
-    char tmp[256];
-    strncpy(tmp, ownersCSV, sizeof(tmp));
-    tmp[sizeof(tmp)-1] = '\0';
+    int fd = open(DB_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) errMsg("open snapshot");
+    db_save(fd, db, c);
+    close(fd);
 
-    int ownerCount = 0;
-    char *tok = strtok(tmp, ",");
-    while (tok && ownerCount < MAX_OWNERS) {
-        if (user_index(&db, tok) == -1) {
-            unlock_file(dbfd);
-            send_all(cfd, "ERR One or more owners do not exist (REGISTER them first)\nEND\n");
-            return;
-        }
-        strncpy(a.owners[ownerCount], tok, USERNAME_LEN);
-        a.owners[ownerCount][USERNAME_LEN-1] = '\0';
-        ownerCount++;
-        tok = strtok(NULL, ",");
-    }
+    if (rename(DB_FILE ".tmp", DB_FILE) == -1) errMsg("rename snapshot");
+    fsync_dir();
+}
 
-    if (ownerCount == 0) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR ownersCSV is empty\nEND\n");
-        return;
-    }
+/* bring the snapshot up to db->lsn in one go; caller holds the store write
+ * lock (or runs before the workers) */
+static void snapshot_write(DB *db) {
+    static SnapshotCut cut;
+    snapshot_cut(db, &cut);
+    snapshot_save(db, &cut);
+}
 
-    /* For IND, enforce only one owner and must be loggedUser */
-    if (!isJoint) {
-        if (ownerCount != 1) {
-            unlock_file(dbfd);
-            send_all(cfd, "ERR IND account must have exactly 1 owner\nEND\n");
-            return;
+/* replace a version 1 or 2 file (256-byte records, fixed USD/EUR/GBP
+ * balances) with a full rewrite in the current v3 layout, via a temp file */
+static void bin_upgrade(DB *db) {
+    int fd = open(BIN_FILE ".tmp", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) errMsg("open snapshot");
+    bin_save(fd, db);
+    if (rename(BIN_FILE ".tmp", BIN_FILE) == -1) errMsg("rename snapshot");
+    fsync_dir();
+    close(g_binfd);
+    g_binfd = fd;
+}
+
+/* --------- write-ahead log ---------- */
+/* One record per line, "<lsn> <OP> <args...>". Amounts are decimals in the
+ * currency's minor-unit precision (logs from before fixed-point money hold
+ * longer fractions, which replay rounds half-even):
+ *   <lsn> REG <user> <pass>
+ *   <lsn> ACC <id> IND|JOINT <ownersCSV>
+ *   <lsn> DEP|WDR <accid> <CUR> <amount>
+ *   <lsn> EXC <accid> <FROMCUR> <amount> <TOCUR> <converted>
+ *   <lsn> XFR <fromacc> <toacc> <CUR> <amount> <TOCUR> <credited>
+ *   <lsn> BAT <n>          (the next n records are one BATCH)
+ * Records with lsn <= the snapshot's LSN are already folded into it; so are
+ * those a binary record was written after (see BIN_FILE). Returns 0 when
+ * applied, 1 when already reflected, -1 when unparsable. */
+static int wal_apply(DB *db, long long lsn, const char *rec) {
+    char op[8];
+    int n = 0;
+    if (sscanf(rec, "%7s %n", op, &n) != 1) return -1;
+    const char *args = rec + n;
+
+    if (strcmp(op, "BAT") == 0) {
+        return 0;    /* wal_replay has checked the batch is complete */
+    } else if (strcmp(op, "REG") == 0) {
+        char u[USERNAME_LEN], p[PASS_LEN];
+        if (sscanf(args, "%31s %31s", u, p) != 2) return -1;
+        if (user_index(db, u) != -1) return 1;
+        if (db_add_user(db, u, p) == -1) errMsg("wal_replay: store arena full");
+    } else if (strcmp(op, "ACC") == 0) {
+        char id[ACCID_LEN], type[16], ownersCSV[256];
+        if (sscanf(args, "%31s %15s %255s", id, type, ownersCSV) != 3) return -1;
+        if (account_index(db, id) != -1) return 1;
+        Account a;
+        memset(&a, 0, sizeof(a));
+        strncpy(a.id, id, ACCID_LEN);
+        a.isJoint = (strcmp(type, "JOINT") == 0) ? 1 : 0;
+        split_owners(&a, ownersCSV, MAX_OWNERS);
+        acct_open_balances(&a);
+        if (db_add_account(db, &a) == -1) errMsg("wal_replay: store arena full");
+    } else if (strcmp(op, "DEP") == 0 || strcmp(op, "WDR") == 0) {
+        char accid[ACCID_LEN], curS[8], amountS[64];
+        int64_t amount;
+        if (sscanf(args, "%31s %7s %63s", accid, curS, amountS) != 3) return -1;
+        int idx = account_index(db, accid);
+        int cur = parse_currency(curS);
+        if (idx == -1 || cur < 0 ||
+            money_parse(amountS, CUR_DIGITS(cur), ROUND_HALF_EVEN, &amount) == -1)
+            return -1;
+        Account *a = db_account(db, idx);
+        if (lsn <= a->fileLsn) return 1;
+        int k = acct_slot(a, cur);
+        if (k == -1) return -1;
+        a->bal[k].minor += (op[0] == 'D') ? amount : -amount;
+        acct_drop_empty(a);
+        db_touch_account(db, idx);
+    } else if (strcmp(op, "EXC") == 0) {
+        char accid[ACCID_LEN], fromS[8], toS[8], amountS[64], convertedS[64];
+        int64_t amount, converted;
+        if (sscanf(args, "%31s %7s %63s %7s %63s",
+                   accid, fromS, amountS, toS, convertedS) != 5)
+            return -1;
+        int idx = account_index(db, accid);
+        int from = parse_currency(fromS);
+        int to = parse_currency(toS);
+        if (idx == -1 || from < 0 || to < 0 ||
+            money_parse(amountS, CUR_DIGITS(from), ROUND_HALF_EVEN, &amount) == -1 ||
+            money_parse(convertedS, CUR_DIGITS(to), ROUND_HALF_EVEN, &converted) == -1)
+            return -1;
+        Account *a = db_account(db, idx);
+        if (lsn <= a->fileLsn) return 1;
+        int kf = acct_slot(a, from), kt = acct_slot(a, to);
+        if (kf == -1 || kt == -1) return -1;
+        a->bal[kf].minor -= amount;
+        a->bal[kt].minor += converted;
+        acct_drop_empty(a);
+        db_touch_account(db, idx);
+    } else if (strcmp(op, "XFR") == 0) {
+        char fromId[ACCID_LEN], toId[ACCID_LEN], curS[8], toCurS[8], amountS[64], creditedS[64];
+        int64_t amount, credited;
+        if (sscanf(args, "%31s %31s %7s %63s %7s %63s",
+                   fromId, toId, curS, amountS, toCurS, creditedS) != 6)
+            return -1;
+        int ia = account_index(db, fromId), ib = account_index(db, toId);
+        int cur = parse_currency(curS);
+        int toCur = parse_currency(toCurS);
+        if (ia == -1 || ib == -1 || cur < 0 || toCur < 0 ||
+            money_parse(amountS, CUR_DIGITS(cur), ROUND_HALF_EVEN, &amount) == -1 ||
+            money_parse(creditedS, CUR_DIGITS(toCur), ROUND_HALF_EVEN, &credited) == -1)
+            return -1;
+        /* each side may already be in its BIN_FILE record on its own */
+        Account *a = db_account(db, ia), *b = db_account(db, ib);
+        if (lsn <= a->fileLsn && lsn <= b->fileLsn) return 1;
+        int kf = acct_slot(a, cur), kt = acct_slot(b, toCur);
+        if (kf == -1 || kt == -1) return -1;
+        if (lsn > a->fileLsn) {
+            a->bal[kf].minor -= amount;
+            acct_drop_empty(a);
+            db_touch_account(db, ia);
         }
-        if (strcmp(a.owners[0], loggedUser) != 0) {
-            unlock_file(dbfd);
-            send_all(cfd, "ERR IND account owner must be the logged-in user\nEND\n");
-            return;
+        if (lsn > b->fileLsn) {
+            b->bal[kt].minor += credited;
+            db_touch_account(db, ib);
         }
     } else {
-        /* JOINT: require loggedUser included */
-        int ok = 0;
-        for (int i = 0; i < ownerCount; i++) {
-            if (strcmp(a.owners[i], loggedUser) == 0) ok = 1;
-        }
-        if (!ok) {
-            unlock_file(dbfd);
-            send_all(cfd, "ERR JOINT account must include logged-in user among owners\nEND\n");
-            return;
+        return -1;
+    }
+    return 0;
+}
+
+/* are the count records after fp's position all complete? fp is left
+ * where it was */
+static int wal_batch_complete(FILE *fp, int count) {
+    off_t at = ftello(fp);
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len = 0;
+    while (count > 0 && (len = getline(&line, &cap, fp)) > 0 && line[len-1] == '\n')
+        count--;
+    free(line);
+    if (fseeko(fp, at, SEEK_SET) == -1) errMsg("fseeko WAL");
+    return count == 0;
+}
+
+/* replay records newer than the snapshot; returns how many were applied.
+ * A torn or unparsable tail (crash mid-append) ends replay and is cut off so
+ * later appends do not land behind garbage; so does a BATCH whose records
+ * did not all reach the disk, which is dropped whole. */
+static long wal_replay(int fd, DB *db) {
+    lseek(fd, 0, SEEK_SET);
+    FILE *fp = fdopen(dup(fd), "r");
+    if (!fp) errMsg("fdopen");
+
+    long applied = 0;
+    off_t good = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len-1] != '\n') break;    /* incomplete last record */
+        trim_newline(line);
+
+        long long lsn;
+        int n = 0;
+        if (sscanf(line, "%lld %n", &lsn, &n) != 1) break;
+        int count;
+        if (sscanf(line + n, "BAT %d", &count) == 1 && !wal_batch_complete(fp, count)) break;
+        if (lsn > db->lsn) {
+            if (wal_apply(db, lsn, line + n) == -1) break;
+            db->lsn = lsn;
+            applied++;
         }
+        good += len;
     }
+    free(line);
+    fclose(fp);
 
-    a.ownerCount = ownerCount;
-    for (int i = 0; i < CUR_COUNT; i++) a.bal[i] = 0.0;
+    if (ftruncate(fd, good) == -1) errMsg("ftruncate WAL");
+    return applied;
+}
 
-    db.accounts[db.accCount++] = a;
+static void wal_append(const char *rec, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(g_walfd, rec, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            errMsg("write WAL");
+        }
+        rec += w;
+        len -= (size_t)w;
+    }
+}
 
-    db_save_locked(dbfd, &db);
-    unlock_file(dbfd);
+/* --------- io_uring ---------- */
+/* Just enough of liburing: set up a ring, fill sqes, submit them all (and
+ * wait for completions) with one io_uring_enter, reap cqes. */
+static int uring_init(Uring *r, unsigned entries, unsigned cqEntries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (cqEntries) {
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cqEntries;
+    }
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd == -1) return -1;
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cqSize > sqSize) sqSize = cqSize;
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        int e = errno;
+        close(r->fd);
+        errno = e;
+        return -1;
+    }
 
-    char out[128];
-    snprintf(out, sizeof(out), "OK Created %s\nEND\n", a.id);
-    send_all(cfd, out);
+    r->sqHead = (unsigned *)(sq + p.sq_off.head);
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sqEntries = p.sq_entries;
+    r->features = p.features;
+    r->tail = r->submitted = *r->sqTail;
+    return 0;
 }
 
-static void cmd_list_accounts(int cfd, int dbfd, const char *loggedUser) {
-    if (loggedUser[0] == '\0') {
-        send_all(cfd, "ERR Please LOGIN first\nEND\n");
-        return;
+/* hand every queued sqe to the kernel; wait for at least `wait` completions */
+static void uring_submit(Uring *r, unsigned wait) {
+    __atomic_store_n(r->sqTail, r->tail, __ATOMIC_RELEASE);
+    while (1) {
+        long n = syscall(__NR_io_uring_enter, r->fd, r->tail - r->submitted, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            r->submitted += (unsigned)n;
+            return;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EBUSY) return;  /* reap first, then retry */
+        errMsg("io_uring_enter");
     }
+}
 
-    lock_file(dbfd, F_RDLCK);
+/* a zeroed sqe; submits what is queued if the ring is full */
+static struct io_uring_sqe *uring_sqe(Uring *r) {
+    while (r->tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->sqEntries)
+        uring_submit(r, 0);
+    unsigned i = r->tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqArray[i] = i;
+    r->tail++;
+    return sqe;
+}
 
-    DB db;
-    db_load_locked(dbfd, &db);
+/* pop one completion; 0 if there is none */
+static int uring_cqe(Uring *r, struct io_uring_cqe *out) {
+    unsigned head = *r->cqHead;
+    if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) return 0;
+    *out = r->cqes[head & *r->cqMask];
+    __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
 
-    send_all(cfd, "OK Accounts:\n");
-    for (int i = 0; i < db.accCount; i++) {
-        Account *a = &db.accounts[i];
-        if (!is_owner(a, loggedUser)) continue;
+/* --------- group commit ---------- */
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-        char ownersCSV[256] = {0};
-        for (int k = 0; k < a->ownerCount; k++) {
-            strcat(ownersCSV, a->owners[k]);
-            if (k < a->ownerCount - 1) strcat(ownersCSV, ",");
-        }
 
-        char line[512];
-        snprintf(line, sizeof(line),
-                 "  %s  %s  owners=%s\n",
-                 a->id, a->isJoint ? "JOINT" : "IND", ownersCSV);
-        send_all(cfd, line);
-    }
-    send_all(cfd, "END\n");
+static void gc_init(GroupCommit *gc) {
+    pshared_mutex_init(&gc->mx);
 
-    unlock_file(dbfd);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&gc->flushed, &ca) != 0 ||
+        pthread_cond_init(&gc->appended, &ca) != 0)
+        errMsg("pthread_cond_init");
+    pthread_condattr_destroy(&ca);
 }
 
-static void cmd_balances(int cfd, int dbfd, const char *loggedUser, const char *accid) {
-    if (loggedUser[0] == '\0') {
-        send_all(cfd, "ERR Please LOGIN first\nEND\n");
-        return;
+/* everything up to lsn is durable by other means (e.g. a checkpoint) */
+static void gc_durable(long long lsn) {
+    GroupCommit *gc = &g_store->gc;
+    pshared_lock(&gc->mx);
+    if (gc->written < lsn) gc->written = lsn;
+    if (gc->durable < lsn) gc->durable = lsn;
+    pthread_cond_broadcast(&gc->flushed);
+    pthread_mutex_unlock(&gc->mx);
+}
+
+/* block until lsn is on disk */
+static void wal_wait(long long lsn) {
+    GroupCommit *gc = &g_store->gc;
+    if (gc->durable >= lsn) return;
+    pshared_lock(&gc->mx);
+    while (gc->durable < lsn) pshared_wait(&gc->flushed, &gc->mx, NULL);
+    pthread_mutex_unlock(&gc->mx);
+}
+
+/* hand a record to the writer; caller has just taken lsn. Waits only if the
+ * writer is a whole ring behind. */
+static void wal_enqueue(long long lsn, const char *rec, int len) {
+    WalQueue *q = &g_store->walq;
+    while (lsn - atomic_load(&q->consumed) > WAL_RING) sched_yield();
+
+    WalCell *c = &q->cells[lsn % WAL_RING];
+    memcpy(c->rec, rec, (size_t)len);
+    c->len = len;
+    c->queuedUs = now_us();
+    atomic_store(&c->lsn, lsn);
+
+    if (atomic_load(&q->sleeping)) {
+        pshared_lock(&g_store->gc.mx);
+        pthread_cond_signal(&g_store->gc.appended);
+        pthread_mutex_unlock(&g_store->gc.mx);
     }
+}
 
-    lock_file(dbfd, F_RDLCK);
+static int wal_queued(long long lsn) {
+    return atomic_load(&g_store->walq.cells[lsn % WAL_RING].lsn) == lsn;
+}
 
-    DB db;
-    db_load_locked(dbfd, &db);
+/* the last walLock owner died after taking lsn: if its record never made
+ * it into the ring, queue an empty one so the writer can move past it */
+static void wal_fill_hole(long long lsn) {
+    if (lsn <= atomic_load(&g_store->walq.consumed) || wal_queued(lsn)) return;
+    fprintf(stderr, "Skipping WAL lsn %lld of a dead worker\n", lsn);
+    wal_enqueue(lsn, "", 0);
+}
 
-    int idx = account_index(&db, accid);
-    if (idx == -1) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR No such account\nEND\n");
-        return;
+/* writer: sleep until lsn is queued or the deadline (0 = none) passes */
+static void wal_wait_queued(long long lsn, long long deadline) {
+    GroupCommit *gc = &g_store->gc;
+    WalQueue *q = &g_store->walq;
+    struct timespec ts = { deadline / 1000000LL, (deadline % 1000000LL) * 1000 };
+
+    pshared_lock(&gc->mx);
+    atomic_store(&q->sleeping, 1);
+    while (!wal_queued(lsn)) {
+        if (deadline == 0) pshared_wait(&gc->appended, &gc->mx, NULL);
+        else if (pshared_wait(&gc->appended, &gc->mx, &ts) == ETIMEDOUT) break;
     }
+    atomic_store(&q->sleeping, 0);
+    pthread_mutex_unlock(&gc->mx);
+}
 
-    Account *a = &db.accounts[idx];
-    if (!is_owner(a, loggedUser)) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR Not an owner\nEND\n");
-        return;
+/* wake epoll workers holding replies for the WAL */
+static void wal_notify_workers(void) {
+    uint64_t one = 1;
+    for (int i = 0; i < g_workerCount; i++) {
+        if (atomic_load(&g_workers[i].ackWaiting) > 0 &&
+            write(g_workers[i].efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            errMsg("write eventfd");
     }
-
-    char out[256];
-    snprintf(out, sizeof(out),
-             "OK %s balances: USD=%.2f EUR=%.2f GBP=%.2f\nEND\n",
-             a->id, a->bal[CUR_USD], a->bal[CUR_EUR], a->bal[CUR_GBP]);
-    unlock_file(dbfd);
-    send_all(cfd, out);
 }
 
-static void cmd_deposit_withdraw(int cfd, int dbfd, const char *loggedUser,
-                                 const char *op, const char *accid, const char *curS, double amount) {
-    if (loggedUser[0] == '\0') {
-        send_all(cfd, "ERR Please LOGIN first\nEND\n");
+/* append a batch and make it durable: with --io uring one submission of a
+ * write linked to an fdatasync, otherwise the two syscalls */
+static void wal_flush(const char *buf, size_t len) {
+    if (!g_walUring) {
+        wal_append(buf, len);
+        if (fdatasync(g_walfd) == -1) errMsg("fdatasync WAL");
         return;
     }
-    if (amount <= 0.0) {
-        send_all(cfd, "ERR amount must be > 0\nEND\n");
-        return;
+
+    Uring *r = &g_walRing;
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = g_walfd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->off = (uint64_t)-1;           /* file position, i.e. the end (O_APPEND) */
+    sqe->user_data = 0;
+    sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = g_walfd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = 1;
+
+    int res[2] = { 0, 0 }, got = 0;
+    while (got < 2) {
+        uring_submit(r, (unsigned)(2 - got));
+        struct io_uring_cqe cqe;
+        while (uring_cqe(r, &cqe)) {
+            res[cqe.user_data & 1] = cqe.res;
+            got++;
+        }
     }
+    if (res[0] < 0) {
+        errno = -res[0];
+        errMsg("write WAL");
+    }
+    if ((size_t)res[0] < len) {
+        /* a short write breaks the link and cancels the fsync */
+        wal_append(buf + res[0], len - (size_t)res[0]);
+        if (fdatasync(g_walfd) == -1) errMsg("fdatasync WAL");
+    } else if (res[1] < 0) {
+        errno = -res[1];
+        errMsg("fdatasync WAL");
+    }
+}
 
-    int cur = parse_currency(curS);
-    if (cur < 0) {
-        send_all(cfd, "ERR Unknown currency (USD/EUR/GBP)\nEND\n");
-        return;
+/* The only thread that writes the WAL. Each round copies out every queued
+ * record in lsn order (waiting up to --commit-window-us for more while fewer
+ * than --commit-batch are pending), then appends them all and makes them
+ * durable in one go (wal_flush). */
+static void *wal_writer_main(void *arg) {
+    char *buf = arg;
+    GroupCommit *gc = &g_store->gc;
+    WalQueue *q = &g_store->walq;
+
+    long long next = atomic_load(&q->consumed) + 1;
+    while (1) {
+        while (!wal_queued(next)) wal_wait_queued(next, 0);
+
+        long long first = next, deadline = now_us() + g_cfg.commitWindowUs;
+        long long queuedSum = 0, queuedMin = 0;
+        size_t len = 0;
+        while (1) {
+            while (len + WAL_REC_MAX <= WAL_BATCH_BYTES && wal_queued(next)) {
+                WalCell *c = &q->cells[next % WAL_RING];
+                memcpy(buf + len, c->rec, (size_t)c->len);
+                len += (size_t)c->len;
+                queuedSum += c->queuedUs;
+                if (next == first || c->queuedUs < queuedMin) queuedMin = c->queuedUs;
+                atomic_store(&q->consumed, next);
+                next++;
+            }
+            if (g_cfg.commitWindowUs == 0 || next - first >= g_cfg.commitBatch ||
+                len + WAL_REC_MAX > WAL_BATCH_BYTES || now_us() >= deadline)
+                break;
+            wal_wait_queued(next, deadline);
+        }
+
+        wal_flush(buf, len);
+
+        unsigned long long batch = (unsigned long long)(next - first);
+        long long done = now_us();
+        pshared_lock(&gc->mx);
+        gc->written = next - 1;
+        gc->durable = next - 1;
+        gc->flushes++;
+        gc->records += batch;
+        if (batch > gc->maxBatch) gc->maxBatch = batch;
+        gc->commits += batch;
+        gc->latencyUsTotal += (unsigned long long)((long long)batch * done - queuedSum);
+        if ((unsigned long long)(done - queuedMin) > gc->latencyUsMax)
+            gc->latencyUsMax = (unsigned long long)(done - queuedMin);
+        pthread_cond_broadcast(&gc->flushed);
+        pthread_mutex_unlock(&gc->mx);
+        wal_notify_workers();
     }
+    return NULL;
+}
 
-    lock_file(dbfd, F_WRLCK); /* critical section */
+/* fold the WAL into a fresh snapshot and start a new log; only while
+ * nothing else runs (startup) */
+static void checkpoint(void) {
+    snapshot_write(&g_store->db);
+    if (ftruncate(g_walfd, 0) == -1) errMsg("ftruncate WAL");
+    g_store->walRecords = 0;
+    gc_durable(g_store->db.lsn);
+}
 
-    DB db;
-    db_load_locked(dbfd, &db);
+/* Set the log aside as WAL_OLD_FILE and carry on in an empty one. Caller
+ * holds the store write lock and has waited for the writer to finish with
+ * the old log, so no record can go to either file meanwhile. */
+static void wal_rotate(void) {
+    if (rename(WAL_FILE, WAL_OLD_FILE) == -1) errMsg("rename WAL");
+    int fd = open(WAL_FILE, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd == -1) errMsg("open WAL_FILE");
+    /* the new name must be on disk before a record in it is acknowledged */
+    fsync_dir();
+    /* same descriptor number, so the writer just carries on */
+    if (dup2(fd, g_walfd) == -1) errMsg("dup2 WAL");
+    close(fd);
+    lock_instance(g_walfd);  /* record locks are per file: take the new one */
+}
 
-    int idx = account_index(&db, accid);
-    if (idx == -1) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR No such account\nEND\n");
-        return;
+/* --------- shared in-memory store ---------- */
+/* refuse to start from an empty snapshot while the other format holds data:
+ * replaying the WAL onto an empty DB would discard it */
+static void check_format(int fd) {
+    const char *other = (g_cfg.format == FORMAT_BINARY) ? DB_FILE : BIN_FILE;
+    struct stat st, ost;
+    if (fstat(fd, &st) == 0 && st.st_size == 0 &&
+        stat(other, &ost) == 0 && ost.st_size > 0) {
+        fprintf(stderr, "%s holds the data; start with --format %s or convert it "
+                "with --convert %s\n", other,
+                g_cfg.format == FORMAT_BINARY ? "text" : "binary",
+                g_cfg.format == FORMAT_BINARY ? "binary" : "text");
+        exit(EXIT_FAILURE);
     }
+}
 
-    Account *a = &db.accounts[idx];
-    if (!is_owner(a, loggedUser)) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR Not an owner\nEND\n");
-        return;
+static void store_create(void) {
+    size_t size = (size_t)g_cfg.storeGb << 30;
+    g_store = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (g_store == MAP_FAILED) errMsg("mmap store");
+    g_store->arenaSize = size;
+    g_store->arenaUsed = sizeof(Store);
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    /* glibc prefers readers by default, and balance updates hold the lock
+       shared nearly all the time, so REGISTER, CREATE_ACCOUNT and
+       checkpoints could wait forever; nothing takes it recursively */
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    if (pthread_rwlock_init(&g_store->lock, &attr) != 0) errMsg("pthread_rwlock_init");
+    pthread_rwlockattr_destroy(&attr);
+    for (int i = 0; i < ACC_LOCK_STRIPES; i++) pshared_mutex_init(&g_store->accLocks[i]);
+    pshared_mutex_init(&g_store->walLock);
+    pshared_mutex_init(&g_store->epochLock);
+    for (int i = 0; i < FORK_READERS; i++) pshared_mutex_init(&g_store->forkReaders[i].owner);
+    pshared_mutex_init(&g_store->rateLock);
+    gc_init(&g_store->gc);
+
+    /* WAL fd is opened once; children inherit it (O_APPEND keeps their
+       writes at the end even after a checkpoint truncates the file) */
+    g_walfd = open(WAL_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (g_walfd == -1) errMsg("open WAL_FILE");
+    lock_instance(g_walfd);
+
+    /* one parse at startup; from here on memory is authoritative */
+    DB *db = &g_store->db;
+    long long fileLsn = 0;
+    if (g_cfg.format == FORMAT_BINARY) {
+        /* kept open: flushes pwrite records in place */
+        g_binfd = open(BIN_FILE, O_RDWR | O_CREAT, 0644);
+        if (g_binfd == -1) errMsg("open BIN_FILE");
+        check_format(g_binfd);
+        int legacy;
+        fileLsn = bin_load(g_binfd, db, &legacy);
+        if (legacy) bin_upgrade(db);
+        db->trackDirty = 1;
+    } else {
+        int dbfd = open(DB_FILE, O_RDONLY | O_CREAT, 0644);
+        if (dbfd == -1) errMsg("open DB_FILE");
+        check_format(dbfd);
+        db_load(dbfd, db);
+        close(dbfd);
     }
 
-    if (strcmp(op, "DEPOSIT") == 0) {
-        a->bal[cur] += amount;
-    } else if (strcmp(op, "WITHDRAW") == 0) {
-        if (a->bal[cur] < amount) {
-            unlock_file(dbfd);
-            send_all(cfd, "ERR Insufficient funds\nEND\n");
-            return;
-        }
-        a->bal[cur] -= amount;
+    /* a checkpoint that never finished left the log before its cut */
+    int oldfd = open(WAL_OLD_FILE, O_RDWR);
+    if (oldfd != -1) {
+        g_store->walRecords = wal_replay(oldfd, db);
+        close(oldfd);
+    }
+    g_store->walRecords += wal_replay(g_walfd, db);
+    /* after a torn binary flush some records are ahead of the header;
+       new lsns must stay above theirs */
+    if (db->lsn < fileLsn) db->lsn = fileLsn;
+    if (oldfd != -1 || (g_store->walRecords > 0 && g_cfg.persist != PERSIST_WAL))
+        checkpoint();
+    if (oldfd != -1 && unlink(WAL_OLD_FILE) == -1) errMsg("unlink " WAL_OLD_FILE);
+    g_store->gc.written = g_store->gc.durable = db->lsn;
+    g_store->walq.consumed = db->lsn;
+
+    if (g_cfg.persist == PERSIST_MMAP) {
+        /* from here on records are written through the mapping, which is
+           created before any fork so every process shares its pages */
+        db->trackDirty = 0;
+        struct stat st;
+        if (fstat(g_binfd, &st) == -1) errMsg("fstat " BIN_FILE);
+        if (st.st_size < BIN_REC_SIZE) bin_write_header(g_binfd, db->lsn);
+        g_store->binSize = st.st_size < BIN_REC_SIZE ? BIN_REC_SIZE : st.st_size;
+        g_store->binMapSize = (size_t)g_cfg.storeGb << 30;
+        g_binmap = mmap(NULL, g_store->binMapSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_NORESERVE, g_binfd, 0);
+        if (g_binmap == MAP_FAILED) errMsg("mmap " BIN_FILE);
+    }
+}
+
+/* --convert: load the other format (plus the WAL), write this one in full,
+ * move the source file aside to <name>.bak and empty the WAL. Without the
+ * source, a restart with the old --format finds an empty snapshot next to
+ * a full one and refuses (check_format) instead of loading stale data;
+ * the WAL is emptied last, so a crash before then only leaves records the
+ * new file already holds. */
+static void convert_db(DbFormat to) {
+    g_cfg.format = (to == FORMAT_BINARY) ? FORMAT_TEXT : FORMAT_BINARY;
+    g_cfg.persist = PERSIST_WAL;
+    store_create();
+    DB *db = &g_store->db;
+
+    const char *file = (to == FORMAT_BINARY) ? BIN_FILE : DB_FILE;
+    if (to == FORMAT_BINARY) {
+        int fd = open(BIN_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) errMsg("open snapshot");
+        bin_save(fd, db);
+        close(fd);
+        if (rename(BIN_FILE ".tmp", BIN_FILE) == -1) errMsg("rename snapshot");
+        fsync_dir();
     } else {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR Internal op\nEND\n");
-        return;
+        g_cfg.format = FORMAT_TEXT;
+        snapshot_write(db);
     }
+    const char *src = (to == FORMAT_BINARY) ? DB_FILE : BIN_FILE;
+    char bak[64];
+    snprintf(bak, sizeof(bak), "%s.bak", src);
+    if (rename(src, bak) == -1) errMsg("rename source snapshot");
+    fsync_dir();
+    if (ftruncate(g_walfd, 0) == -1) errMsg("ftruncate WAL");
+
+    printf("Wrote %d users and %d accounts to %s (old file kept as %s)\n",
+           db->userCount, db->accCount, file, bak);
+}
 
-    db_save_locked(dbfd, &db);
-    unlock_file(dbfd);
+/* The store lock is a process-shared rwlock, which cannot be robust: a fork
+ * mode child killed while holding it leaves writers blocked. Workers never
+ * hold it across client I/O, so only a crash inside a command can do that. */
+static void store_rdlock(void) {
+    if (pthread_rwlock_rdlock(&g_store->lock) != 0) errMsg("store rdlock");
+}
 
-    send_all(cfd, "OK Done\nEND\n");
+static void store_wrlock(void) {
+    if (pthread_rwlock_wrlock(&g_store->lock) != 0) errMsg("store wrlock");
 }
 
-static void cmd_exchange(int cfd, int dbfd, const char *loggedUser,
-                         const char *accid, const char *fromS, const char *toS, double amount) {
-    if (loggedUser[0] == '\0') {
-        send_all(cfd, "ERR Please LOGIN first\nEND\n");
-        return;
-    }
-    if (amount <= 0.0) {
-        send_all(cfd, "ERR amount must be > 0\nEND\n");
-        return;
+static void store_unlock(void) {
+    pthread_rwlock_unlock(&g_store->lock);
+}
+
+/* store lock for balance updates: shared in WAL mode, where the account
+ * stripes keep updates apart, but exclusive in snapshot mode because
+ * store_persist() then writes out the whole DB */
+static void store_updlock(void) {
+    if (g_cfg.persist == PERSIST_SNAPSHOT) store_wrlock();
+    else store_rdlock();
+}
+
+/* The owner of stripe died inside its critical section: close any seqlock
+ * it left open so readers stop spinning. The half-applied update, if any,
+ * was never logged, so the log is still right; the memory may not be until
+ * the next restart replays it. */
+static void stripe_recover(int stripe) {
+    DB *db = &g_store->db;
+    int bad = 0;
+    for (int i = stripe; i < db->accCount; i += ACC_LOCK_STRIPES) {
+        Account *a = db_account(db, i);
+        if (atomic_load(&a->seq) & 1) {
+            acct_write_end(a);
+            bad++;
+        }
     }
+    fprintf(stderr, "Recovered account lock %d from a dead worker (%d open writes)\n",
+            stripe, bad);
+}
 
-    int from = parse_currency(fromS);
-    int to = parse_currency(toS);
-    if (from < 0 || to < 0) {
-        send_all(cfd, "ERR Unknown currency (USD/EUR/GBP)\nEND\n");
-        return;
+/* lock the stripes of n accounts (duplicates allowed) in ascending order,
+ * so operations touching several accounts cannot deadlock each other;
+ * caller holds the store lock */
+static void store_lock_accounts(const int *idx, int n) {
+    int s[MAX_LOCK_SET];
+    if (n > MAX_LOCK_SET) errMsg("store_lock_accounts: lock set too large");
+    for (int i = 0; i < n; i++) {
+        int v = idx[i] % ACC_LOCK_STRIPES, j = i;
+        for (; j > 0 && s[j - 1] > v; j--) s[j] = s[j - 1];
+        s[j] = v;
     }
-    if (from == to) {
-        send_all(cfd, "ERR FROMCUR and TOCUR must differ\nEND\n");
-        return;
+    for (int i = 0; i < n; i++) {
+        if ((i == 0 || s[i] != s[i - 1]) && pshared_lock(&g_store->accLocks[s[i]]))
+            stripe_recover(s[i]);
     }
+}
 
-    lock_file(dbfd, F_WRLCK); /* critical section */
-
-    DB db;
-    db_load_locked(dbfd, &db);
-
-    int idx = account_index(&db, accid);
-    if (idx == -1) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR No such account\nEND\n");
-        return;
+static void store_unlock_accounts(const int *idx, int n) {
+    for (int i = 0; i < n; i++) {
+        int v = idx[i] % ACC_LOCK_STRIPES, seen = 0;
+        for (int j = 0; j < i; j++) seen |= (idx[j] % ACC_LOCK_STRIPES == v);
+        if (!seen) pthread_mutex_unlock(&g_store->accLocks[v]);
     }
+}
 
-    Account *a = &db.accounts[idx];
-    if (!is_owner(a, loggedUser)) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR Not an owner\nEND\n");
-        return;
+static void store_lock_account(int idx) { store_lock_accounts(&idx, 1); }
+static void store_unlock_account(int idx) { store_unlock_accounts(&idx, 1); }
+
+/* Log the mutation just applied to the store; caller holds the store lock
+ * and the locks of the accounts involved. fmt/... describe it as a WAL
+ * record (without the lsn). In WAL mode this queues one line for the writer
+ * thread and returns its lsn, which the caller passes to store_commit()
+ * after unlocking; in snapshot mode the whole file is rewritten here and 0
+ * (nothing to wait for) is returned. */
+static long long store_persist(const char *fmt, ...) {
+    DB *db = &g_store->db;
+
+    if (g_cfg.persist != PERSIST_WAL) {
+        /* mmap: the records are already in the mapping, store_commit syncs */
+        pshared_lock(&g_store->walLock);
+        ++db->lsn;
+        if (g_cfg.persist == PERSIST_SNAPSHOT) snapshot_write(db);
+        pthread_mutex_unlock(&g_store->walLock);
+        return 0;
     }
 
-    if (a->bal[from] < amount) {
-        unlock_file(dbfd);
-        send_all(cfd, "ERR Insufficient funds\nEND\n");
+    /* the account locks order records for the same account; the ring
+       orders everything else by lsn. A fork mode child could die between
+       taking its lsn and queueing the record, leaving a hole the writer
+       would wait on forever, so there both happen under walLock. */
+    int forked = g_cfg.io == IO_FORK;
+    if (forked && pshared_lock(&g_store->walLock)) wal_fill_hole(db->lsn);
+    long long lsn = __atomic_add_fetch(&db->lsn, 1, __ATOMIC_SEQ_CST);
+    char rec[WAL_REC_MAX];
+    int n = snprintf(rec, sizeof(rec), "%lld ", lsn);
+    va_list ap;
+    va_start(ap, fmt);
+    n += vsnprintf(rec + n, sizeof(rec) - (size_t)n - 1, fmt, ap);
+    va_end(ap);
+    if (n > (int)sizeof(rec) - 2) n = (int)sizeof(rec) - 2;
+    rec[n++] = '\n';
+
+    wal_enqueue(lsn, rec, n);
+    if (forked) pthread_mutex_unlock(&g_store->walLock);
+    g_store->walRecords++;
+    return lsn;
+}
+
+/* make the reply wait until lsn is durable (with --persist mmap: msync what
+ * this thread changed); called with no store locks held. An epoll worker
+ * does not block: it only notes the lsn in t_commitLsn and holds the
+ * session's replies until the writer gets there. Checkpoints are left to
+ * checkpoint_main. */
+static void store_commit(long long lsn) {
+    if (g_cfg.persist == PERSIST_MMAP) {
+        bin_map_sync();
         return;
     }
+    if (g_cfg.durability == DURABILITY_STRICT) {
+        if (g_cfg.io == IO_FORK) wal_wait(lsn);
+        else if (lsn > t_commitLsn) t_commitLsn = lsn;
+    }
+}
 
-    double r = rate((Currency)from, (Currency)to);
-    double converted = amount * r;
+/* Checkpoints run here, off the request path. Once --checkpoint-every
+ * records are logged: under the store write lock, cut the DB at its lsn
+ * and rotate the log; then, with the lock released, write the snapshot and
+ * drop the old log. Workers wait only for the cut, a copy of the balances
+ * (text) or of the changed records (binary). A crash in between leaves
+ * both logs, which startup replays in order. */
+static void *checkpoint_main(void *arg) {
+    (void)arg;
+    GroupCommit *gc = &g_store->gc;
+    DB *db = &g_store->db;
+    SnapshotCut cut;
+    memset(&cut, 0, sizeof(cut));
 
-    a->bal[from] -= amount;
-    a->bal[to] += converted;
+    while (1) {
+        pshared_lock(&gc->mx);
+        while (g_store->walRecords < g_cfg.checkpointEvery)
+            pshared_wait(&gc->flushed, &gc->mx, NULL);
+        pthread_mutex_unlock(&gc->mx);
+
+        store_wrlock();
+        wal_wait(db->lsn);
+        snapshot_cut(db, &cut);
+        wal_rotate();
+        g_store->walRecords = 0;
+        store_unlock();
+
+        snapshot_save(db, &cut);
+        if (unlink(WAL_OLD_FILE) == -1) errMsg("unlink " WAL_OLD_FILE);
+    }
+    return NULL;
+}
 
-    db_save_locked(dbfd, &db);
-    unlock_file(dbfd);
+/* start the writer and the checkpointer in this process: before the workers
+ * run, or before the first fork (children only enqueue) */
+static void wal_writer_start(void) {
+    if (g_cfg.persist != PERSIST_WAL) return;
+    g_walUring = g_cfg.io == IO_URING && uring_init(&g_walRing, 4, 0) == 0 &&
+                 (g_walRing.features & IORING_FEAT_RW_CUR_POS);
+    char *buf = malloc(WAL_BATCH_BYTES);   /* here, not racing a fork */
+    if (!buf) errMsg("malloc");
+    pthread_t th;
+    if (pthread_create(&th, NULL, wal_writer_main, buf) != 0) errMsg("pthread_create");
+    pthread_detach(th);
+    if (pthread_create(&th, NULL, checkpoint_main, NULL) != 0) errMsg("pthread_create");
+    pthread_detach(th);
+}
 
-    char out[256];
-    snprintf(out, sizeof(out), "OK Exchanged %.2f %s -> %.2f %s (rate=%.6f)\nEND\n",
-             amount, CUR_NAMES[from], converted, CUR_NAMES[to], r);
-    send_all(cfd, out);
+/* --------- sessions ---------- */
+/* Per-connection state, shared by both I/O models. Command handlers never
+ * write to the socket: they format straight into out, and the fork loop or
+ * the epoll loop flushes it with one send() per batch of commands (the
+ * response, any further pipelined responses and the next READY> prompt all
+ * leave in the same segment). */
+typedef struct Session {
+    int fd;
+    int quit;                     /* QUIT seen: close once out is drained */
+    int pipelined;                /* PIPELINE ON: no READY> prompts */
+    int binary;                   /* PROTOCOL BINARY: frames both ways */
+    unsigned events;              /* epoll interest currently registered; with
+                                     io_uring, EPOLLIN/EPOLLOUT = recv/send in flight */
+    char loggedUser[USERNAME_LEN];
+    int discarding;               /* inside an over-long line, skip to '\n' */
+    size_t inOff, inLen;          /* unconsumed input is in[inOff, inLen) */
+    char in[IN_BUF_SIZE];
+    char *out;                    /* pending response bytes [outOff, outLen) */
+    size_t outOff, outLen, outCap;
+    char *sending;                /* io_uring: buffer of the send in flight */
+    size_t sendOff, sendLen, sendCap;
+    int batching;                 /* between BATCH and COMMIT or ABORT */
+    struct BatchOp *batch;        /* the operations queued so far */
+    int batchLen, batchCap;       /* batchLen keeps counting past BATCH_MAX */
+    long long ackLsn;             /* out may not be sent before this is durable */
+    struct Session *ackPrev, *ackNext;  /* on the worker's ackList while set */
+} Session;
+
+static void session_init(Session *sess, int fd) {
+    memset(sess, 0, sizeof(*sess));
+    sess->fd = fd;
 }
 
-/* --------- client handler ---------- */
-static void handleClient(int cfd, int dbfd) {
-    char line[BUFFER_SIZE];
-    char loggedUser[USERNAME_LEN] = {0};
+static void session_free(Session *sess) {
+    free(sess->out);
+    free(sess->sending);
+    free(sess->batch);
+    sess->out = sess->sending = NULL;
+    sess->batch = NULL;
+}
 
-    /* Welcome block */
-    send_all(cfd, "OK Currency Exchange Server\nType HELP for commands\nEND\n");
+/* make room for len more bytes after outLen; returns the free space */
+static size_t out_reserve(Session *sess, size_t len) {
+    if (sess->outLen + len > sess->outCap && sess->outOff > 0) {
+        /* reclaim the already-sent prefix before growing */
+        memmove(sess->out, sess->out + sess->outOff, sess->outLen - sess->outOff);
+        sess->outLen -= sess->outOff;
+        sess->outOff = 0;
+    }
+    if (sess->outLen + len > sess->outCap) {
+        size_t cap = sess->outCap ? sess->outCap : 1024;
+        while (cap < sess->outLen + len) cap *= 2;
+        char *p = realloc(sess->out, cap);
+        if (!p) errMsg("realloc");
+        sess->out = p;
+        sess->outCap = cap;
+    }
+    return sess->outCap - sess->outLen;
+}
 
-    while (1) {
-        if (send_all(cfd, "READY>\n") == -1) break;
+static void reply_bytes(Session *sess, const void *p, size_t len) {
+    out_reserve(sess, len);
+    memcpy(sess->out + sess->outLen, p, len);
+    sess->outLen += len;
+}
 
-        int rc = recv_line(cfd, line, sizeof(line));
-        if (rc == 0) break;
-        if (rc < 0) errMsg("read");
+static void reply(Session *sess, const char *str) {
+    reply_bytes(sess, str, strlen(str));
+}
 
-        trim_newline(line);
-        if (line[0] == '\0') continue;
+/* printf straight into the output buffer (no intermediate copy) */
+static void replyf(Session *sess, const char *fmt, ...) {
+    size_t room = out_reserve(sess, 256);
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(sess->out + sess->outLen, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+
+    if ((size_t)n >= room) {
+        room = out_reserve(sess, (size_t)n + 1);
+        va_start(ap, fmt);
+        vsnprintf(sess->out + sess->outLen, room, fmt, ap);
+        va_end(ap);
+    }
+    sess->outLen += (size_t)n;
+}
 
-        char cmd[32];
-        if (sscanf(line, "%31s", cmd) != 1) continue;
+static size_t session_pending(const Session *sess) {
+    return sess->outLen - sess->outOff;
+}
 
-        if (strcmp(cmd, "HELP") == 0) {
-            cmd_help(cfd);
-        } else if (strcmp(cmd, "RATES") == 0) {
-            cmd_rates(cfd);
-        } else if (strcmp(cmd, "REGISTER") == 0) {
-            char u[USERNAME_LEN], p[PASS_LEN];
-            if (sscanf(line, "REGISTER %31s %31s", u, p) != 2) {
-                send_all(cfd, "ERR Usage: REGISTER <user> <pass>\nEND\n");
-            } else {
-                cmd_register(cfd, dbfd, u, p);
-            }
-        } else if (strcmp(cmd, "LOGIN") == 0) {
-            char u[USERNAME_LEN], p[PASS_LEN];
-            if (sscanf(line, "LOGIN %31s %31s", u, p) != 2) {
-                send_all(cfd, "ERR Usage: LOGIN <user> <pass>\nEND\n");
-            } else {
-                cmd_login(cfd, dbfd, u, p, loggedUser);
-            }
-        } else if (strcmp(cmd, "CREATE_ACCOUNT") == 0) {
-            char type[16], ownersCSV[256];
-            if (sscanf(line, "CREATE_ACCOUNT %15s %255s", type, ownersCSV) != 2) {
-                send_all(cfd, "ERR Usage: CREATE_ACCOUNT IND|JOINT <ownersCSV>\nEND\n");
-            } else {
-                cmd_create_account(cfd, dbfd, loggedUser, type, ownersCSV);
-            }
-        } else if (strcmp(cmd, "LIST_ACCOUNTS") == 0) {
-            cmd_list_accounts(cfd, dbfd, loggedUser);
-        } else if (strcmp(cmd, "BALANCES") == 0) {
-            char accid[ACCID_LEN];
-            if (sscanf(line, "BALANCES %31s", accid) != 1) {
-                send_all(cfd, "ERR Usage: BALANCES <accid>\nEND\n");
-            } else {
-                cmd_balances(cfd, dbfd, loggedUser, accid);
-            }
-        } else if (strcmp(cmd, "DEPOSIT") == 0 || strcmp(cmd, "WITHDRAW") == 0) {
-            char accid[ACCID_LEN], curS[8];
-            double amount;
-            if (sscanf(line, "%31s %31s %7s %lf", cmd, accid, curS, &amount) != 4) {
-                send_all(cfd, "ERR Usage: DEPOSIT|WITHDRAW <accid> <CUR> <amount>\nEND\n");
-            } else {
-                cmd_deposit_withdraw(cfd, dbfd, loggedUser, cmd, accid, curS, amount);
-            }
-        } else if (strcmp(cmd, "EXCHANGE") == 0) {
-            char accid[ACCID_LEN], fromS[8], toS[8];
-            double amount;
-            if (sscanf(line, "EXCHANGE %31s %7s %7s %lf", accid, fromS, toS, &amount) != 4) {
-                send_all(cfd, "ERR Usage: EXCHANGE <accid> <FROMCUR> <TOCUR> <amount>\nEND\n");
-            } else {
-                cmd_exchange(cfd, dbfd, loggedUser, accid, fromS, toS, amount);
-            }
-        } else if (strcmp(cmd, "QUIT") == 0) {
-            send_all(cfd, "OK Bye\nEND\n");
-            break;
-        } else {
-            send_all(cfd, "ERR Unknown command (try HELP)\nEND\n");
+/* write pending output; returns 0 when drained, 1 if the (non-blocking)
+ * socket is full, -1 on error. Short writes resume at outOff. */
+static int session_flush(Session *sess) {
+    while (sess->outOff < sess->outLen) {
+        ssize_t w = send(sess->fd, sess->out + sess->outOff, sess->outLen - sess->outOff,
+                         MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
         }
+        sess->outOff += (size_t)w;
+    }
+    sess->outOff = sess->outLen = 0;
+    if (sess->outCap > OUT_KEEP) {
+        /* don't let one big LIST_ACCOUNTS pin memory on an idle session */
+        free(sess->out);
+        sess->out = NULL;
+        sess->outCap = 0;
     }
+    return 0;
+}
 
-    close(cfd);
-    exit(EXIT_SUCCESS);
+/* --------- account operations ---------- */
+/* The operations that move money, shared by the text commands and the
+ * binary protocol. Arguments arrive parsed; each returns OP_OK or the
+ * reason it refused, whose text is in OP_ERRORS. */
+typedef enum {
+    OP_OK = 0, OP_ERR, OP_NOT_LOGGED_IN, OP_NO_ACCOUNT, OP_NOT_OWNER,
+    OP_UNKNOWN_CURRENCY, OP_INVALID_AMOUNT, OP_NOT_POSITIVE, OP_SAME_CURRENCY,
+    OP_NO_RATE, OP_TOO_SMALL, OP_INSUFFICIENT, OP_TOO_MANY_CURRENCIES, OP_LIMIT,
+    OP_PRECISION, OP_SAME_ACCOUNT, OP_UNAVAILABLE
+} OpStatus;
+
+static const char *const OP_ERRORS[] = {
+    [OP_OK] = "Done",
+    [OP_ERR] = "Error",
+    [OP_NOT_LOGGED_IN] = "Please LOGIN first",
+    [OP_NO_ACCOUNT] = "No such account",
+    [OP_NOT_OWNER] = "Not an owner",
+    [OP_UNKNOWN_CURRENCY] = "Unknown currency",
+    [OP_INVALID_AMOUNT] = "Invalid amount",
+    [OP_NOT_POSITIVE] = "amount must be > 0",
+    [OP_SAME_CURRENCY] = "FROMCUR and TOCUR must differ",
+    [OP_NO_RATE] = "No rate",
+    [OP_TOO_SMALL] = "Amount too small to exchange",
+    [OP_INSUFFICIENT] = "Insufficient funds",
+    [OP_TOO_MANY_CURRENCIES] = "Account holds too many currencies",
+    [OP_LIMIT] = "Balance limit exceeded",
+    [OP_PRECISION] = "Too many decimal places",
+    [OP_SAME_ACCOUNT] = "Cannot transfer to the same account",
+    [OP_UNAVAILABLE] = "Not available with --persist mmap",
+};
+
+/* the reason as shown to clients; names the pair for OP_NO_RATE and the
+ * currency's precision for OP_PRECISION */
+static const char *op_message(char *buf, size_t size, OpStatus st, int from, int to) {
+    if (st == OP_NO_RATE)
+        snprintf(buf, size, "No rate for %s -> %s", CUR_CODE(from), CUR_CODE(to));
+    else if (st == OP_PRECISION && CUR_DIGITS(from) == 0)
+        snprintf(buf, size, "%s takes no decimal places", CUR_CODE(from));
+    else if (st == OP_PRECISION)
+        snprintf(buf, size, "%s takes at most %d decimal places", CUR_CODE(from), CUR_DIGITS(from));
+    else
+        return OP_ERRORS[st];
+    return buf;
 }
 
-int main() {
-    int lfd, cfd;
-    struct sockaddr_in serv_addr, client_addr;
-    socklen_t addrlen = sizeof(client_addr);
-    int reuse = 1;
+/* index of account accid, provided loggedUser owns it */
+static OpStatus op_owned_account(const char *loggedUser, const char *accid, int *idx) {
+    if (loggedUser[0] == '\0') return OP_NOT_LOGGED_IN;
+    DB *db = &g_store->db;
+    *idx = account_index(db, accid);
+    if (*idx == -1) return OP_NO_ACCOUNT;
+    if (!is_owner(db_account(db, *idx), loggedUser)) return OP_NOT_OWNER;
+    return OP_OK;
+}
+
+/* no lock: the index and owners are read as published, the balances
+   through the account's seqlock */
+static OpStatus op_balances(const char *loggedUser, const char *accid,
+                            Balance bal[ACC_CURRENCIES], int *n) {
+    int idx;
+    OpStatus st = op_owned_account(loggedUser, accid, &idx);
+    if (st != OP_OK) return st;
+    *n = acct_read_balances(db_account(&g_store->db, idx), bal);
+    return OP_OK;
+}
+
+/* Can a locked account give up out minor units of from and take in minor
+ * units of to? Either may be 0: a deposit only takes in, a withdrawal only
+ * gives out, an exchange does both. */
+static OpStatus acct_move_check(const Account *a, int from, int64_t out, int to, int64_t in) {
+    if (out > 0) {
+        int k = acct_find(a, from);
+        if (k == -1 || a->bal[k].minor < out) return OP_INSUFFICIENT;
+    }
+    if (in > 0) {
+        int k = acct_find(a, to);
+        if (k == -1 && a->balCount == ACC_CURRENCIES) return OP_TOO_MANY_CURRENCIES;
+        if (k != -1 && a->bal[k].minor > MONEY_MAX - in) return OP_LIMIT;
+    }
+    return OP_OK;
+}
+
+/* apply a checked move; caller is inside the account's seqlock write and
+ * calls acct_drop_empty once the operation can no longer be undone */
+static void acct_move(Account *a, int from, int64_t out, int to, int64_t in) {
+    if (out > 0) a->bal[acct_find(a, from)].minor -= out;
+    if (in > 0) a->bal[acct_slot(a, to)].minor += in;
+}
+
+/* add (deposit) or take amount minor units of cur; *balance is the result */
+static OpStatus op_deposit_withdraw(const char *loggedUser, int deposit, const char *accid,
+                                    int cur, int64_t amount, int64_t *balance) {
+    if (loggedUser[0] == '\0') return OP_NOT_LOGGED_IN;
+    if (amount <= 0) return OP_NOT_POSITIVE;
+    if (amount > MONEY_MAX) return OP_INVALID_AMOUNT;
+
+    store_updlock();
+
+    int idx;
+    OpStatus st = op_owned_account(loggedUser, accid, &idx);
+    if (st != OP_OK) {
+        store_unlock();
+        return st;
+    }
+
+    DB *db = &g_store->db;
+    Account *a = db_account(db, idx);
+    int64_t out = deposit ? 0 : amount, in = deposit ? amount : 0;
+    store_lock_account(idx); /* critical section */
+    st = acct_move_check(a, cur, out, cur, in);
+    if (st != OP_OK) {
+        store_unlock_account(idx);
+        store_unlock();
+        return st;
+    }
+
+    acct_write_begin(a);
+    acct_move(a, cur, out, cur, in);
+    *balance = a->bal[acct_find(a, cur)].minor;
+    acct_drop_empty(a);
+    acct_write_end(a);
+    db_touch_account(db, idx);
+
+    char amt[MONEY_STR];
+    long long lsn = store_persist("%s %s %s %s", deposit ? "DEP" : "WDR",
+                                  a->id, CUR_CODE(cur), fmt_money(amt, amount, cur));
+    store_unlock_account(idx);
+    store_unlock();
+    store_commit(lsn);
+    return OP_OK;
+}
+
+/* what amount minor units of `from` are worth in `to` right now */
+static OpStatus op_quote(int from, int to, int64_t amount, int64_t *converted,
+                         int64_t *rate, uint64_t *version) {
+    if (from == to) return OP_SAME_CURRENCY;
+    if (amount <= 0) return OP_NOT_POSITIVE;
+    if (amount > MONEY_MAX) return OP_INVALID_AMOUNT;
+    *rate = rate_lookup(from, to, version);
+    if (*rate == -1) return OP_NO_RATE;
+    *converted = money_convert(amount, from, to, *rate);
+    if (*converted == -1) return OP_INVALID_AMOUNT;
+    if (*converted == 0) return OP_TOO_SMALL;
+    return OP_OK;
+}
+
+/* convert amount minor units of `from` into `to` at the current rate */
+static OpStatus op_exchange(const char *loggedUser, const char *accid, int from, int to,
+                            int64_t amount, int64_t *converted, int64_t *rate,
+                            uint64_t *version) {
+    if (loggedUser[0] == '\0') return OP_NOT_LOGGED_IN;
+    OpStatus st = op_quote(from, to, amount, converted, rate, version);
+    if (st != OP_OK) return st;
+
+    store_updlock();
+
+    int idx;
+    st = op_owned_account(loggedUser, accid, &idx);
+    if (st != OP_OK) {
+        store_unlock();
+        return st;
+    }
+
+    DB *db = &g_store->db;
+    Account *a = db_account(db, idx);
+    store_lock_account(idx); /* critical section */
+    st = acct_move_check(a, from, amount, to, *converted);
+    if (st != OP_OK) {
+        store_unlock_account(idx);
+        store_unlock();
+        return st;
+    }
+
+    acct_write_begin(a);
+    acct_move(a, from, amount, to, *converted);
+    acct_drop_empty(a);
+    acct_write_end(a);
+    db_touch_account(db, idx);
+
+    char amt[MONEY_STR], conv[MONEY_STR];
+    long long lsn = store_persist("EXC %s %s %s %s %s", a->id,
+                                  CUR_CODE(from), fmt_money(amt, amount, from),
+                                  CUR_CODE(to), fmt_money(conv, *converted, to));
+    store_unlock_account(idx);
+    store_unlock();
+    store_commit(lsn);
+    return OP_OK;
+}
+
+/* Move amount minor units of cur out of fromAcc, which loggedUser must own,
+ * into toAcc, which may be anyone's, credited in toCur at the current rate
+ * when that is another currency. Both accounts are locked (stripes in
+ * ascending order, so transfers cannot deadlock and those between other
+ * accounts go on in parallel) and both updates are one WAL record. With
+ * --persist mmap there is no WAL, and the two records could reach the disk
+ * one without the other, so it is refused. */
+static OpStatus op_transfer(const char *loggedUser, const char *fromAcc, const char *toAcc,
+                            int cur, int toCur, int64_t amount, int64_t *credited,
+                            int64_t *rate, uint64_t *version) {
+    if (loggedUser[0] == '\0') return OP_NOT_LOGGED_IN;
+    if (g_cfg.persist == PERSIST_MMAP) return OP_UNAVAILABLE;
+    if (strcmp(fromAcc, toAcc) == 0) return OP_SAME_ACCOUNT;
+    OpStatus st;
+    if (toCur != cur) {
+        st = op_quote(cur, toCur, amount, credited, rate, version);
+        if (st != OP_OK) return st;
+    } else {
+        if (amount <= 0) return OP_NOT_POSITIVE;
+        if (amount > MONEY_MAX) return OP_INVALID_AMOUNT;
+        *credited = amount;
+        *rate = RATE_SCALE;
+        *version = 0;
+    }
+
+    store_updlock();
+
+    DB *db = &g_store->db;
+    int idx[2];
+    st = op_owned_account(loggedUser, fromAcc, &idx[0]);
+    if (st == OP_OK && (idx[1] = account_index(db, toAcc)) == -1) st = OP_NO_ACCOUNT;
+    if (st != OP_OK) {
+        store_unlock();
+        return st;
+    }
+
+    Account *a = db_account(db, idx[0]), *b = db_account(db, idx[1]);
+    store_lock_accounts(idx, 2); /* critical section */
+    st = acct_move_check(a, cur, amount, cur, 0);
+    if (st == OP_OK) st = acct_move_check(b, toCur, 0, toCur, *credited);
+    if (st != OP_OK) {
+        store_unlock_accounts(idx, 2);
+        store_unlock();
+        return st;
+    }
+
+    acct_write_begin(a);
+    acct_write_begin(b);
+    acct_move(a, cur, amount, cur, 0);
+    acct_move(b, toCur, 0, toCur, *credited);
+    acct_drop_empty(a);
+    acct_write_end(b);
+    acct_write_end(a);
+    db_touch_account(db, idx[0]);
+    db_touch_account(db, idx[1]);
+
+    char amt[MONEY_STR], cred[MONEY_STR];
+    long long lsn = store_persist("XFR %s %s %s %s %s %s", a->id, b->id,
+                                  CUR_CODE(cur), fmt_money(amt, amount, cur),
+                                  CUR_CODE(toCur), fmt_money(cred, *credited, toCur));
+    store_unlock_accounts(idx, 2);
+    store_unlock();
+    store_commit(lsn);
+    return OP_OK;
+}
+
+/* One queued operation of a BATCH. Each moves out minor units of `from`
+ * and in minor units of `to` on one account (see acct_move_check). */
+typedef enum { BATCH_DEPOSIT, BATCH_WITHDRAW, BATCH_EXCHANGE, BATCH_BAD } BatchKind;
+
+typedef struct BatchOp {
+    BatchKind kind;
+    int from, to;                 /* currencies; the same unless exchanging */
+    char accid[ACCID_LEN];
+    int64_t amount;               /* in `from` */
+    int64_t converted, rate;      /* exchange quote, taken at commit */
+    uint64_t version;
+    OpStatus st;                  /* result; OP_ERR with why for BATCH_BAD */
+    const char *why;
+    int idx;                      /* account, once resolved */
+    int balCount;                 /* its currency count before this op (undo) */
+    int first;                    /* this op opened the account's seqlock write */
+} BatchOp;
+
+static void batch_amounts(const BatchOp *op, int64_t *out, int64_t *in) {
+    *out = op->kind == BATCH_DEPOSIT ? 0 : op->amount;
+    *in = op->kind == BATCH_DEPOSIT ? op->amount
+        : op->kind == BATCH_EXCHANGE ? op->converted : 0;
+}
+
+/* take back ops [0, n) of a batch that failed, newest first, and close the
+ * seqlock writes it opened */
+static void batch_undo(BatchOp *ops, int n) {
+    DB *db = &g_store->db;
+    for (int i = n - 1; i >= 0; i--) {
+        Account *a = db_account(db, ops[i].idx);
+        int64_t out, in;
+        batch_amounts(&ops[i], &out, &in);
+        if (in > 0) a->bal[acct_find(a, ops[i].to)].minor -= in;
+        if (out > 0) a->bal[acct_find(a, ops[i].from)].minor += out;
+        a->balCount = ops[i].balCount;
+        if (ops[i].first) acct_write_end(a);
+    }
+}
+
+/* Apply n operations all or nothing. Every op is checked on its own first,
+ * so a client learns about each bad line at once; then, under one exclusive
+ * store lock, they are applied in order, each seeing the ones before it, and
+ * the first that cannot go through rolls the others back. Readers never see
+ * part of a batch: each account stays inside its seqlock write until the
+ * whole batch is in. The batch is logged as a "BAT <n>" record followed by
+ * the n operations' own records, which replay only applies if all of them
+ * made it to disk. Returns how many operations failed; their st says why. */
+static int op_batch(const char *loggedUser, BatchOp *ops, int n) {
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        BatchOp *op = &ops[i];
+        if (op->kind == BATCH_BAD) {
+            failed++;
+            continue;
+        }
+        if (loggedUser[0] == '\0') op->st = OP_NOT_LOGGED_IN;
+        else if (op->kind == BATCH_EXCHANGE)
+            op->st = op_quote(op->from, op->to, op->amount, &op->converted,
+                              &op->rate, &op->version);
+        else if (op->amount <= 0) op->st = OP_NOT_POSITIVE;
+        else op->st = OP_OK;
+        failed += (op->st != OP_OK);
+    }
+    if (failed || n == 0) return failed;
+
+    store_wrlock();
+
+    DB *db = &g_store->db;
+    for (int i = 0; i < n; i++) {
+        BatchOp *op = &ops[i];
+        op->st = op_owned_account(loggedUser, op->accid, &op->idx);
+        Account *a = op->st == OP_OK ? db_account(db, op->idx) : NULL;
+        int64_t out, in;
+        batch_amounts(op, &out, &in);
+        if (a) op->st = acct_move_check(a, op->from, out, op->to, in);
+        if (op->st != OP_OK) {
+            batch_undo(ops, i);
+            store_unlock();
+            return 1;
+        }
+        /* we hold the store exclusively, so an odd seq is our own write */
+        op->first = !(atomic_load_explicit(&a->seq, memory_order_relaxed) & 1);
+        if (op->first) acct_write_begin(a);
+        op->balCount = a->balCount;
+        acct_move(a, op->from, out, op->to, in);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!ops[i].first) continue;
+        acct_drop_empty(db_account(db, ops[i].idx));
+        acct_write_end(db_account(db, ops[i].idx));
+        db_touch_account(db, ops[i].idx);
+    }
+
+    long long lsn = store_persist("BAT %d", n);
+    for (int i = 0; i < n; i++) {
+        BatchOp *op = &ops[i];
+        char amt[MONEY_STR], conv[MONEY_STR];
+        if (g_cfg.persist != PERSIST_WAL) {
+            /* the one store_persist above already wrote everything */
+        } else if (op->kind == BATCH_EXCHANGE) {
+            lsn = store_persist("EXC %s %s %s %s %s", op->accid,
+                                CUR_CODE(op->from), fmt_money(amt, op->amount, op->from),
+                                CUR_CODE(op->to), fmt_money(conv, op->converted, op->to));
+        } else {
+            lsn = store_persist("%s %s %s %s", op->kind == BATCH_DEPOSIT ? "DEP" : "WDR",
+                                op->accid, CUR_CODE(op->from),
+                                fmt_money(amt, op->amount, op->from));
+        }
+    }
+    store_unlock();
+    store_commit(lsn);
+    return 0;
+}
+
+/* --------- commands ---------- */
+static void cmd_help(Session *sess) {
+    reply(sess,
+        "OK Commands:\n"
+        "  REGISTER <user> <pass>\n"
+        "  LOGIN <user> <pass>\n"
+        "  RATES\n"
+        "  CREATE_ACCOUNT IND|JOINT <ownersCSV>\n"
+        "  LIST_ACCOUNTS\n"
+        "  BALANCES <accid>\n"
+        "  DEPOSIT <accid> <CUR> <amount>\n"
+        "  WITHDRAW <accid> <CUR> <amount>\n"
+        "  EXCHANGE <accid> <FROMCUR> <TOCUR> <amount>\n"
+        "  TRANSFER <fromacc> <toacc> <CUR> <amount> [TOCUR]\n"
+        "  BATCH, then DEPOSIT/WITHDRAW/EXCHANGE lines, then COMMIT or ABORT\n"
+        "    (QUIT or disconnecting also discards an open batch)\n"
+        "  STATS\n"
+        "  PIPELINE ON|OFF\n"
+        "  PROTOCOL BINARY\n"
+        "  QUIT\n"
+        "END\n");
+}
+
+/* With pipelining on the server stops sending READY> prompts, so a client can
+ * stream commands without waiting and read back exactly one END-terminated
+ * response per command, in order. */
+static void cmd_pipeline(Session *sess, const char *mode) {
+    if (strcmp(mode, "ON") == 0) {
+        sess->pipelined = 1;
+        reply(sess, "OK Pipelining on\nEND\n");
+    } else if (strcmp(mode, "OFF") == 0) {
+        sess->pipelined = 0;
+        reply(sess, "OK Pipelining off\nEND\n");
+    } else {
+        reply(sess, "ERR Usage: PIPELINE ON|OFF\nEND\n");
+    }
+}
+
+/* Switch this connection to the binary protocol (see FrameHeader). The OK
+ * is the last text the client gets; everything after this line, both ways,
+ * is frames. */
+static void cmd_protocol(Session *sess, const char *mode) {
+    if (strcmp(mode, "BINARY") == 0) {
+        sess->binary = 1;
+        reply(sess, "OK Binary protocol\nEND\n");
+    } else {
+        reply(sess, "ERR Usage: PROTOCOL BINARY\nEND\n");
+    }
+}
+
+static void cmd_stats(Session *sess) {
+    GroupCommit *gc = &g_store->gc;
+
+    pshared_lock(&gc->mx);
+    unsigned long long flushes = gc->flushes, records = gc->records, maxBatch = gc->maxBatch;
+    unsigned long long commits = gc->commits, latTotal = gc->latencyUsTotal, latMax = gc->latencyUsMax;
+    long long durable = gc->durable;
+    pthread_mutex_unlock(&gc->mx);
+
+    replyf(sess,
+           "OK Stats:\n"
+           "  durable_lsn=%lld\n"
+           "  wal_flushes=%llu records=%llu avg_batch=%.2f max_batch=%llu\n"
+           "  commits=%llu avg_commit_us=%.1f max_commit_us=%llu\n",
+           durable,
+           flushes, records, flushes ? (double)records / flushes : 0.0, maxBatch,
+           commits, commits ? (double)latTotal / commits : 0.0, latMax);
+    uint64_t ratesVersion;
+    rate_lookup(0, 0, &ratesVersion);
+    replyf(sess, "  rates_version=%llu\n", (unsigned long long)ratesVersion);
+
+    for (int i = 0; i < g_workerCount; i++) {
+        Worker *w = &g_workers[i];
+        replyf(sess, "  worker%d accepted=%lu active=%lu commands=%lu\n",
+               w->id, atomic_load(&w->accepted), atomic_load(&w->active),
+               atomic_load(&w->commands));
+    }
+    reply(sess, "END\n");
+}
+
+/* a RATE_SCALE rate shown with `digits` decimals */
+static char *fmt_rate(char *out, int64_t r, int digits) {
+    int64_t div = POW10[RATE_DIGITS - digits];
+    return fmt_fixed(out, r / div + (r % div >= div / 2), digits);
+}
+
+static void cmd_rates(Session *sess) {
+    /* copy the quotes out so the epoch only covers the table reads */
+    int16_t cur[CUR_MAX];
+    int64_t quote[CUR_MAX];
+    int ep = epoch_enter();
+    const RateTable *t = atomic_load_explicit(&g_store->rates, memory_order_acquire);
+    int base = t->base, count = t->count;
+    const int64_t *row = t->rate + t->pos[base] * count;
+    memcpy(cur, t->cur, (size_t)count * sizeof(cur[0]));
+    memcpy(quote, row, (size_t)count * sizeof(quote[0]));
+    epoch_exit(ep);
+
+    reply(sess, "OK Rates (approx, fixed):\n");
+    for (int i = 0; i < count; i++) {
+        if (cur[i] == base) continue;
+        /* six decimals, trailing zeros dropped down to two */
+        char r[MONEY_STR];
+        fmt_rate(r, quote[i], 6);
+        size_t len = strlen(r);
+        while (r[len - 1] == '0' && r[len - 3] != '.') r[--len] = '\0';
+        replyf(sess, "  1 %s = %s %s\n", CUR_CODE(base), r, CUR_CODE(cur[i]));
+    }
+    reply(sess, "END\n");
+}
+
+static void cmd_register(Session *sess, const char *u, const char *p) {
+    store_wrlock();
+
+    DB *db = &g_store->db;
+
+    if (user_index(db, u) != -1) {
+        store_unlock();
+        reply(sess, "ERR User already exists\nEND\n");
+        return;
+    }
+
+    if (db_add_user(db, u, p) == -1) {
+        store_unlock();
+        reply(sess, "ERR User limit reached\nEND\n");
+        return;
+    }
+
+    long long lsn = store_persist("REG %s %s", u, p);
+    store_unlock();
+    store_commit(lsn);
+
+    reply(sess, "OK Registered\nEND\n");
+}
+
+static int cmd_login(Session *sess, const char *u, const char *p, char *loggedUser) {
+    DB *db = &g_store->db;
+
+    /* no lock: users are immutable once indexed */
+    int idx = user_index(db, u);
+    if (idx == -1) {
+        reply(sess, "ERR No such user\nEND\n");
+        return 0;
+    }
+    if (strcmp(db_user(db, idx)->password, p) != 0) {
+        reply(sess, "ERR Wrong password\nEND\n");
+        return 0;
+    }
+
+    strncpy(loggedUser, u, USERNAME_LEN - 1);
+    loggedUser[USERNAME_LEN - 1] = '\0';
+    reply(sess, "OK Logged in\nEND\n");
+    return 1;
+}
+
+static void cmd_create_account(Session *sess, const char *loggedUser,
+                               const char *type, const char *ownersCSV) {
+    if (loggedUser[0] == '\0') {
+        reply(sess, "ERR Please LOGIN first\nEND\n");
+        return;
+    }
+
+    int isJoint = 0;
+    if (strcmp(type, "IND") == 0) isJoint = 0;
+    else if (strcmp(type, "JOINT") == 0) isJoint = 1;
+    else {
+        reply(sess, "ERR type must be IND or JOINT\nEND\n");
+        return;
+    }
+
+    store_wrlock();
+
+    DB *db = &g_store->db;
+
+    Account a;
+    memset(&a, 0, sizeof(a));
+    a.isJoint = isJoint;
+
+    if (gen_account_id(db, a.id, sizeof(a.id)) == -1) {
+        store_unlock();
+        reply(sess, "ERR Could not generate account id\nEND\n");
+        return;
+    }
+
+    /* parse owners */
+    char tmp[256];
+    strncpy(tmp, ownersCSV, sizeof(tmp));
+    tmp[sizeof(tmp)-1] = '\0';
+
+    int ownerCount = 0;
+    char *save = NULL;
+    char *tok = strtok_r(tmp, ",", &save);
+    while (tok && ownerCount < MAX_OWNERS) {
+        if (user_index(db, tok) == -1) {
+            store_unlock();
+            reply(sess, "ERR One or more owners do not exist (REGISTER them first)\nEND\n");
+            return;
+        }
+        strncpy(a.owners[ownerCount], tok, USERNAME_LEN);
+        a.owners[ownerCount][USERNAME_LEN-1] = '\0';
+        ownerCount++;
+        tok = strtok_r(NULL, ",", &save);
+    }
+
+    if (ownerCount == 0) {
+        store_unlock();
+        reply(sess, "ERR ownersCSV is empty\nEND\n");
+        return;
+    }
+
+    /* For IND, enforce only one owner and must be loggedUser */
+    if (!isJoint) {
+        if (ownerCount != 1) {
+            store_unlock();
+            reply(sess, "ERR IND account must have exactly 1 owner\nEND\n");
+            return;
+        }
+        if (strcmp(a.owners[0], loggedUser) != 0) {
+            store_unlock();
+            reply(sess, "ERR IND account owner must be the logged-in user\nEND\n");
+            return;
+        }
+    } else {
+        /* JOINT: require loggedUser included */
+        int ok = 0;
+        for (int i = 0; i < ownerCount; i++) {
+            if (strcmp(a.owners[i], loggedUser) == 0) ok = 1;
+        }
+        if (!ok) {
+            store_unlock();
+            reply(sess, "ERR JOINT account must include logged-in user among owners\nEND\n");
+            return;
+        }
+    }
+
+    a.ownerCount = ownerCount;
+    acct_open_balances(&a);
+
+    if (db_add_account(db, &a) == -1) {
+        store_unlock();
+        reply(sess, "ERR Account limit reached\nEND\n");
+        return;
+    }
+
+    long long lsn = store_persist("ACC %s %s %s", a.id, isJoint ? "JOINT" : "IND", ownersCSV);
+    store_unlock();
+    store_commit(lsn);
+
+    replyf(sess, "OK Created %s\nEND\n", a.id);
+}
+
+static void cmd_list_accounts(Session *sess, const char *loggedUser) {
+    if (loggedUser[0] == '\0') {
+        reply(sess, "ERR Please LOGIN first\nEND\n");
+        return;
+    }
+
+    DB *db = &g_store->db;
+
+    /* walk the user's own list instead of scanning every account; no lock:
+       links are only ever appended, and id/type/owners never change */
+    int uidx = user_index(db, loggedUser);
+    int next = (uidx == -1) ? -1
+             : atomic_load_explicit(&db_user(db, uidx)->ownedHead, memory_order_acquire);
+
+    reply(sess, "OK Accounts:\n");
+    while (next != -1) {
+        Account *a = db_account(db, next);
+        next = atomic_load_explicit(&a->ownedNext[owner_slot(a, uidx)], memory_order_acquire);
+
+        char ownersCSV[256] = {0};
+        for (int k = 0; k < a->ownerCount; k++) {
+            strcat(ownersCSV, a->owners[k]);
+            if (k < a->ownerCount - 1) strcat(ownersCSV, ",");
+        }
+
+        replyf(sess, "  %s  %s  owners=%s\n",
+               a->id, a->isJoint ? "JOINT" : "IND", ownersCSV);
+    }
+    reply(sess, "END\n");
+}
+
+/* a client's amount in cur's minor units */
+static OpStatus parse_amount(const char *s, int cur, int64_t *amount) {
+    switch (amount_parse(s, CUR_DIGITS(cur), amount)) {
+    case 0:  return OP_OK;
+    case -2: return OP_PRECISION;
+    default: return OP_INVALID_AMOUNT;
+    }
+}
+
+/* "ERR <reason>" for a refused operation */
+static void reply_op_error(Session *sess, OpStatus st, int from, int to) {
+    char buf[64];
+    replyf(sess, "ERR %s\nEND\n", op_message(buf, sizeof(buf), st, from, to));
+}
+
+static void cmd_balances(Session *sess, const char *loggedUser, const char *accid) {
+    Balance bal[ACC_CURRENCIES];
+    int n;
+    OpStatus st = op_balances(loggedUser, accid, bal, &n);
+    if (st != OP_OK) {
+        reply_op_error(sess, st, 0, 0);
+        return;
+    }
+
+    replyf(sess, "OK %s balances:", accid);
+    for (int k = 0; k < n; k++) {
+        char m[MONEY_STR];
+        replyf(sess, " %s=%s", CUR_CODE(bal[k].cur), fmt_money(m, bal[k].minor, bal[k].cur));
+    }
+    reply(sess, "\nEND\n");
+}
+
+static void cmd_deposit_withdraw(Session *sess, const char *loggedUser,
+                                 int deposit, const char *accid, const char *curS,
+                                 const char *amountS) {
+    if (loggedUser[0] == '\0') {
+        reply(sess, "ERR Please LOGIN first\nEND\n");
+        return;
+    }
+
+    int cur = parse_currency(curS);
+    if (cur < 0) {
+        reply(sess, "ERR Unknown currency\nEND\n");
+        return;
+    }
+    int64_t amount, balance;
+    OpStatus st = parse_amount(amountS, cur, &amount);
+    if (st != OP_OK) {
+        reply_op_error(sess, st, cur, cur);
+        return;
+    }
+
+    st = op_deposit_withdraw(loggedUser, deposit, accid,
+                                      cur, amount, &balance);
+    if (st != OP_OK) reply_op_error(sess, st, cur, cur);
+    else reply(sess, "OK Done\nEND\n");
+}
+
+static void cmd_exchange(Session *sess, const char *loggedUser,
+                         const char *accid, const char *fromS, const char *toS,
+                         const char *amountS) {
+    if (loggedUser[0] == '\0') {
+        reply(sess, "ERR Please LOGIN first\nEND\n");
+        return;
+    }
+
+    int from = parse_currency(fromS);
+    int to = parse_currency(toS);
+    if (from < 0 || to < 0) {
+        reply(sess, "ERR Unknown currency\nEND\n");
+        return;
+    }
+    if (from == to) {
+        reply(sess, "ERR FROMCUR and TOCUR must differ\nEND\n");
+        return;
+    }
+    int64_t amount;
+    OpStatus st = parse_amount(amountS, from, &amount);
+    if (st != OP_OK) {
+        reply_op_error(sess, st, from, from);
+        return;
+    }
+
+    int64_t converted, rate;
+    uint64_t version;
+    st = op_exchange(loggedUser, accid, from, to, amount, &converted, &rate, &version);
+    if (st != OP_OK) {
+        reply_op_error(sess, st, from, to);
+        return;
+    }
+
+    char amt[MONEY_STR], conv[MONEY_STR], r[MONEY_STR];
+    replyf(sess, "OK Exchanged %s %s -> %s %s (rate=%s version=%llu)\nEND\n",
+           fmt_money(amt, amount, from), CUR_CODE(from), fmt_money(conv, converted, to),
+           CUR_CODE(to), fmt_rate(r, rate, 6), (unsigned long long)version);
+}
+
+static void cmd_transfer(Session *sess, const char *loggedUser,
+                         const char *fromAcc, const char *toAcc, const char *curS,
+                         const char *amountS, const char *toCurS) {
+    if (loggedUser[0] == '\0') {
+        reply(sess, "ERR Please LOGIN first\nEND\n");
+        return;
+    }
+
+    int cur = parse_currency(curS);
+    int toCur = toCurS ? parse_currency(toCurS) : cur;
+    if (cur < 0 || toCur < 0) {
+        reply(sess, "ERR Unknown currency\nEND\n");
+        return;
+    }
+    int64_t amount;
+    OpStatus st = parse_amount(amountS, cur, &amount);
+    if (st != OP_OK) {
+        reply_op_error(sess, st, cur, cur);
+        return;
+    }
+
+    int64_t credited, rate;
+    uint64_t version;
+    st = op_transfer(loggedUser, fromAcc, toAcc, cur, toCur, amount, &credited, &rate, &version);
+    if (st != OP_OK) {
+        reply_op_error(sess, st, cur, toCur);
+        return;
+    }
+
+    char amt[MONEY_STR], cred[MONEY_STR], r[MONEY_STR];
+    if (toCur == cur) {
+        replyf(sess, "OK Transferred %s %s from %s to %s\nEND\n",
+               fmt_money(amt, amount, cur), CUR_CODE(cur), fromAcc, toAcc);
+    } else {
+        replyf(sess, "OK Transferred %s %s -> %s %s from %s to %s (rate=%s version=%llu)\nEND\n",
+               fmt_money(amt, amount, cur), CUR_CODE(cur), fmt_money(cred, credited, toCur),
+               CUR_CODE(toCur), fromAcc, toAcc, fmt_rate(r, rate, 6),
+               (unsigned long long)version);
+    }
+}
+
+/* BATCH opens a block: the DEPOSIT, WITHDRAW and EXCHANGE lines up to
+ * COMMIT are only parsed and queued, each answered with where it went, and
+ * COMMIT applies and reports the whole block at once (see op_batch). */
+static void cmd_batch(Session *sess) {
+    if (sess->binary) {
+        reply(sess, "ERR BATCH is not available in binary mode\nEND\n");
+        return;
+    }
+    /* without a WAL the kernel may write back any dirty page of the
+       mapping at any time, so part of a batch could reach the disk */
+    if (g_cfg.persist == PERSIST_MMAP) {
+        reply(sess, "ERR BATCH is not available with --persist mmap\nEND\n");
+        return;
+    }
+    sess->batching = 1;
+    sess->batchLen = 0;
+    reply(sess, "OK Batch started: send operations, then COMMIT or ABORT\nEND\n");
+}
+
+/* the next queued operation, or NULL once the batch is over BATCH_MAX */
+static BatchOp *batch_add(Session *sess, BatchKind kind) {
+    if (sess->batchLen++ >= BATCH_MAX) return NULL;
+    if (sess->batchLen > sess->batchCap) {
+        int cap = sess->batchCap ? sess->batchCap * 2 : 64;
+        BatchOp *b = realloc(sess->batch, (size_t)cap * sizeof(*b));
+        if (!b) errMsg("realloc batch");
+        sess->batch = b;
+        sess->batchCap = cap;
+    }
+    BatchOp *op = &sess->batch[sess->batchLen - 1];
+    memset(op, 0, sizeof(*op));
+    op->kind = kind;
+    return op;
+}
+
+/* answer a queued line (op NULL: it didn't fit); a failure found this
+ * early already dooms the batch, but only COMMIT or ABORT ends it */
+static void batch_ack(Session *sess, const BatchOp *op) {
+    char buf[64];
+    if (!op) {
+        replyf(sess, "ERR Batch too large (at most %d operations)\nEND\n", BATCH_MAX);
+    } else if (op->st != OP_OK) {
+        replyf(sess, "ERR Queued %d: %s\nEND\n", sess->batchLen,
+               op->why ? op->why : op_message(buf, sizeof(buf), op->st, op->from, op->to));
+    } else {
+        replyf(sess, "OK Queued %d\nEND\n", sess->batchLen);
+    }
+}
+
+/* queue a line that can only fail */
+static void batch_reject(Session *sess, OpStatus st, const char *why) {
+    BatchOp *op = batch_add(sess, BATCH_BAD);
+    if (op) {
+        op->st = st;
+        op->why = why;
+    }
+    batch_ack(sess, op);
+}
+
+/* queue one operation; what can be checked without the store already is */
+static void batch_queue(Session *sess, BatchKind kind, const char *accid,
+                        const char *fromS, const char *toS, const char *amountS) {
+    BatchOp *op = batch_add(sess, kind);
+    if (!op) {
+        batch_ack(sess, NULL);
+        return;
+    }
+
+    strncpy(op->accid, accid, ACCID_LEN - 1);
+    op->from = parse_currency(fromS);
+    op->to = toS ? parse_currency(toS) : op->from;
+    if (op->from < 0 || op->to < 0) op->st = OP_UNKNOWN_CURRENCY;
+    else if (kind == BATCH_EXCHANGE && op->from == op->to) op->st = OP_SAME_CURRENCY;
+    else op->st = parse_amount(amountS, op->from, &op->amount);
+    if (op->st != OP_OK) op->kind = BATCH_BAD;
+    batch_ack(sess, op);
+}
+
+static void batch_end(Session *sess) {
+    sess->batching = 0;
+    free(sess->batch);
+    sess->batch = NULL;
+    sess->batchCap = 0;
+}
+
+static void cmd_commit(Session *sess) {
+    BatchOp *ops = sess->batch;
+    int n = sess->batchLen;
+    if (n > BATCH_MAX) {
+        replyf(sess, "ERR Batch too large (at most %d operations)\nEND\n", BATCH_MAX);
+        batch_end(sess);
+        return;
+    }
+
+    int failed = op_batch(sess->loggedUser, ops, n);
+    if (failed) replyf(sess, "ERR Batch rolled back: %d of %d operations failed\n", failed, n);
+    else replyf(sess, "OK Batch committed: %d operations\n", n);
+
+    for (int i = 0; i < n; i++) {
+        const BatchOp *op = &ops[i];
+        char buf[64];
+        if (op->st != OP_OK) {
+            replyf(sess, "  %d ERR %s\n", i + 1,
+                   op->why ? op->why : op_message(buf, sizeof(buf), op->st, op->from, op->to));
+        } else if (failed) {
+            replyf(sess, "  %d SKIPPED\n", i + 1);
+        } else if (op->kind == BATCH_EXCHANGE) {
+            char amt[MONEY_STR], conv[MONEY_STR], r[MONEY_STR];
+            replyf(sess, "  %d OK Exchanged %s %s -> %s %s (rate=%s version=%llu)\n", i + 1,
+                   fmt_money(amt, op->amount, op->from), CUR_CODE(op->from),
+                   fmt_money(conv, op->converted, op->to), CUR_CODE(op->to),
+                   fmt_rate(r, op->rate, 6), (unsigned long long)op->version);
+        } else {
+            replyf(sess, "  %d OK Done\n", i + 1);
+        }
+    }
+    reply(sess, "END\n");
+    batch_end(sess);
+}
+
+static void cmd_abort(Session *sess) {
+    replyf(sess, "OK Batch discarded: %d operations\nEND\n", sess->batchLen);
+    batch_end(sess);
+}
+
+/* --------- command dispatch ---------- */
+#define CMD_ARGS 5
+#define ARG_WHOLE UINT16_MAX   /* width of an argument never cut short */
+
+/* A command's argument schema: how many words it needs (optional ones
+ * after those come through as NULL when missing, any beyond CMD_ARGS are
+ * ignored) and how much of each it keeps, like sscanf's %Ns would; and
+ * what it does between BATCH and COMMIT. */
+typedef struct {
+    const char *name;
+    size_t len;
+    void (*run)(Session *sess, char **arg);
+    int argc;
+    uint16_t width[CMD_ARGS];
+    const char *usage;
+    void (*batched)(Session *sess, char **arg);   /* inside BATCH; NULL: refused */
+} Command;
+
+static void run_help(Session *sess, char **arg) { (void)arg; cmd_help(sess); }
+static void run_rates(Session *sess, char **arg) { (void)arg; cmd_rates(sess); }
+static void run_stats(Session *sess, char **arg) { (void)arg; cmd_stats(sess); }
+static void run_pipeline(Session *sess, char **arg) { cmd_pipeline(sess, arg[0]); }
+static void run_protocol(Session *sess, char **arg) { cmd_protocol(sess, arg[0]); }
+static void run_register(Session *sess, char **arg) { cmd_register(sess, arg[0], arg[1]); }
+
+static void run_login(Session *sess, char **arg) {
+    cmd_login(sess, arg[0], arg[1], sess->loggedUser);
+}
+
+static void run_create_account(Session *sess, char **arg) {
+    cmd_create_account(sess, sess->loggedUser, arg[0], arg[1]);
+}
+
+static void run_list_accounts(Session *sess, char **arg) {
+    (void)arg;
+    cmd_list_accounts(sess, sess->loggedUser);
+}
+
+static void run_balances(Session *sess, char **arg) {
+    cmd_balances(sess, sess->loggedUser, arg[0]);
+}
+
+static void run_deposit(Session *sess, char **arg) {
+    cmd_deposit_withdraw(sess, sess->loggedUser, 1, arg[0], arg[1], arg[2]);
+}
+
+static void run_withdraw(Session *sess, char **arg) {
+    cmd_deposit_withdraw(sess, sess->loggedUser, 0, arg[0], arg[1], arg[2]);
+}
+
+static void run_exchange(Session *sess, char **arg) {
+    cmd_exchange(sess, sess->loggedUser, arg[0], arg[1], arg[2], arg[3]);
+}
+
+static void run_transfer(Session *sess, char **arg) {
+    cmd_transfer(sess, sess->loggedUser, arg[0], arg[1], arg[2], arg[3], arg[4]);
+}
+
+static void run_batch(Session *sess, char **arg) { (void)arg; cmd_batch(sess); }
+static void run_commit(Session *sess, char **arg) { (void)arg; cmd_commit(sess); }
+static void run_abort(Session *sess, char **arg) { (void)arg; cmd_abort(sess); }
+
+static void run_no_batch(Session *sess, char **arg) {
+    (void)arg;
+    reply(sess, "ERR No BATCH in progress\nEND\n");
+}
+
+static void queue_deposit(Session *sess, char **arg) {
+    batch_queue(sess, BATCH_DEPOSIT, arg[0], arg[1], NULL, arg[2]);
+}
+
+static void queue_withdraw(Session *sess, char **arg) {
+    batch_queue(sess, BATCH_WITHDRAW, arg[0], arg[1], NULL, arg[2]);
+}
+
+static void queue_exchange(Session *sess, char **arg) {
+    batch_queue(sess, BATCH_EXCHANGE, arg[0], arg[1], arg[2], arg[3]);
+}
+
+static void run_quit(Session *sess, char **arg) {
+    (void)arg;
+    reply(sess, "OK Bye\nEND\n");
+    sess->quit = 1;
+}
+
+/* Commands sit in the slot their name hashes to, so a lookup is one hash and
+ * one compare however many commands there are. The hash only looks at the
+ * length and the first and last letters, which CMD repeats by hand because a
+ * string literal's bytes are not constant expressions; two names landing in
+ * the same slot is a build error, and commands_check() catches a mistyped
+ * letter at startup. */
+#define CMD_SLOTS 32
+#define CMD_HASH(first, last, len) (((unsigned)(first) + 20u * (unsigned)(last) + (len)) & (CMD_SLOTS - 1))
+#define CMD(first, last, name, ...) \
+    [CMD_HASH(first, last, sizeof(name) - 1)] = { name, sizeof(name) - 1, __VA_ARGS__ }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const Command COMMANDS[CMD_SLOTS] = {
+    CMD('H', 'P', "HELP", run_help, 0, {0}, NULL, run_help),
+    CMD('R', 'S', "RATES", run_rates, 0, {0}, NULL, NULL),
+    CMD('S', 'S', "STATS", run_stats, 0, {0}, NULL, NULL),
+    CMD('P', 'E', "PIPELINE", run_pipeline, 1, {7}, "PIPELINE ON|OFF", NULL),
+    CMD('P', 'L', "PROTOCOL", run_protocol, 1, {7}, "PROTOCOL BINARY", NULL),
+    CMD('R', 'R', "REGISTER", run_register, 2, {USERNAME_LEN - 1, PASS_LEN - 1},
+        "REGISTER <user> <pass>", NULL),
+    CMD('L', 'N', "LOGIN", run_login, 2, {USERNAME_LEN - 1, PASS_LEN - 1},
+        "LOGIN <user> <pass>", NULL),
+    CMD('C', 'T', "CREATE_ACCOUNT", run_create_account, 2, {15, 255},
+        "CREATE_ACCOUNT IND|JOINT <ownersCSV>", NULL),
+    CMD('L', 'S', "LIST_ACCOUNTS", run_list_accounts, 0, {0}, NULL, NULL),
+    CMD('B', 'S', "BALANCES", run_balances, 1, {ACCID_LEN - 1}, "BALANCES <accid>", NULL),
+    CMD('D', 'T', "DEPOSIT", run_deposit, 3, {ACCID_LEN - 1, 7, ARG_WHOLE},
+        "DEPOSIT|WITHDRAW <accid> <CUR> <amount>", queue_deposit),
+    CMD('W', 'W', "WITHDRAW", run_withdraw, 3, {ACCID_LEN - 1, 7, ARG_WHOLE},
+        "DEPOSIT|WITHDRAW <accid> <CUR> <amount>", queue_withdraw),
+    CMD('E', 'E', "EXCHANGE", run_exchange, 4, {ACCID_LEN - 1, 7, 7, ARG_WHOLE},
+        "EXCHANGE <accid> <FROMCUR> <TOCUR> <amount>", queue_exchange),
+    CMD('T', 'R', "TRANSFER", run_transfer, 4,
+        {ACCID_LEN - 1, ACCID_LEN - 1, 7, ARG_WHOLE, 7},
+        "TRANSFER <fromacc> <toacc> <CUR> <amount> [TOCUR]", NULL),
+    CMD('B', 'H', "BATCH", run_batch, 0, {0}, NULL, NULL),
+    CMD('C', 'T', "COMMIT", run_no_batch, 0, {0}, NULL, run_commit),
+    CMD('A', 'T', "ABORT", run_no_batch, 0, {0}, NULL, run_abort),
+    CMD('Q', 'T', "QUIT", run_quit, 0, {0}, NULL, run_quit),
+};
+#pragma GCC diagnostic pop
+
+/* every command must sit in the slot its actual name hashes to, or
+ * command_find() could never reach it */
+static void commands_check(void) {
+    for (int i = 0; i < CMD_SLOTS; i++) {
+        const Command *c = &COMMANDS[i];
+        if (!c->name) continue;
+        if (c->len != strlen(c->name) ||
+            CMD_HASH(c->name[0], c->name[c->len - 1], c->len) != (unsigned)i) {
+            fprintf(stderr, "Command table: %s is in the wrong slot\n", c->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static const Command *command_find(const char *word, size_t len) {
+    const Command *c = &COMMANDS[CMD_HASH(word[0], word[len - 1], len)];
+    if (c->len != len || memcmp(c->name, word, len) != 0) return NULL;
+    return c;
+}
+
+static int is_blank(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* Split line in place into at most max words; returns how many, with len[i]
+ * the length of word[i]. Whatever follows the last word kept is ignored. */
+static int split_words(char *line, char **word, size_t *len, int max) {
+    int n = 0;
+    char *p = line;
+    while (n < max) {
+        while (is_blank(*p)) p++;
+        if (*p == '\0') break;
+        word[n] = p;
+        while (*p != '\0' && !is_blank(*p)) p++;
+        len[n] = (size_t)(p - word[n]);
+        n++;
+        if (*p != '\0') *p++ = '\0';
+    }
+    return n;
+}
+
+static void session_exec(Session *sess, char *line) {
+    char *word[1 + CMD_ARGS] = { NULL };
+    size_t len[1 + CMD_ARGS];
+    int n = split_words(line, word, len, 1 + CMD_ARGS);
+    if (n == 0) return;
+
+    /* inside a batch, errors are queued for COMMIT to report */
+    const Command *c = command_find(word[0], len[0]);
+    if (!c) {
+        if (sess->batching) batch_reject(sess, OP_ERR, "Unknown command");
+        else reply(sess, "ERR Unknown command (try HELP)\nEND\n");
+        return;
+    }
+    void (*run)(Session *, char **) = sess->batching ? c->batched : c->run;
+    if (!run) {
+        batch_reject(sess, OP_ERR, "Not allowed in a batch");
+        return;
+    }
+    if (n - 1 < c->argc) {
+        if (sess->batching) batch_reject(sess, OP_ERR, "Missing arguments");
+        else replyf(sess, "ERR Usage: %s\nEND\n", c->usage);
+        return;
+    }
+    for (int i = 0; i < n - 1; i++) {
+        if (len[1 + i] > c->width[i]) word[1 + i][c->width[i]] = '\0';
+    }
+    run(sess, word + 1);
+}
+
+#define WELCOME "OK Currency Exchange Server\nType HELP for commands\nEND\n"
 
-    /* open DB file once; children inherit fd */
-    int dbfd = open(DB_FILE, O_RDWR | O_CREAT, 0644);
-    if (dbfd == -1) errMsg("open DB_FILE");
+/* --------- binary protocol ---------- */
+/* After PROTOCOL BINARY every request and response is a frame: this header,
+ * then len payload bytes. Integers are little-endian, amounts are integers
+ * in the currency's minor unit, account ids and currency codes are
+ * NUL-padded. A response echoes the request's op; status is OP_OK with the
+ * op's result as payload, or the OpStatus that refused it with the reason
+ * as text. Responses come back in request order. */
+typedef struct {
+    uint32_t len;            /* payload bytes after the header */
+    uint8_t op;              /* BIN_OP_* */
+    uint8_t status;          /* responses: OpStatus */
+    uint16_t reserved;
+} FrameHeader;
+
+enum {
+    BIN_OP_TEXT = 1,         /* a text command line; the text reply */
+    BIN_OP_BALANCES = 2,     /* FrameAccount; FrameBalance per currency */
+    BIN_OP_DEPOSIT = 3,      /* FrameMove; FrameBalance afterwards */
+    BIN_OP_WITHDRAW = 4,     /* FrameMove; FrameBalance afterwards */
+    BIN_OP_EXCHANGE = 5,     /* FrameExchange; FrameExchanged */
+    BIN_OP_TRANSFER = 6      /* FrameTransfer; FrameExchanged */
+};
 
-    /* seed rand for account IDs */
-    srand((unsigned) getpid());
+typedef struct {
+    char acc[ACCID_LEN];
+} FrameAccount;
 
-    lfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (lfd == -1) errMsg("socket");
+typedef struct {
+    char code[4];
+    uint32_t reserved;
+    int64_t minor;
+} FrameBalance;
 
-    if (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
-        errMsg("setsockopt");
+typedef struct {
+    char acc[ACCID_LEN];
+    char code[4];
+    uint32_t reserved;
+    int64_t amount;
+} FrameMove;
 
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(PORT);
+typedef struct {
+    char acc[ACCID_LEN];
+    char from[4];
+    char to[4];
+    int64_t amount;          /* in units of from */
+} FrameExchange;
 
-    if (bind(lfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1)
-        errMsg("bind");
+typedef struct {
+    char from[ACCID_LEN];
+    char to[ACCID_LEN];
+    char code[4];
+    char toCode[4];          /* all NUL: the same as code */
+    int64_t amount;          /* in units of code */
+} FrameTransfer;
 
-    if (listen(lfd, 10) == -1)
-        errMsg("listen");
+typedef struct {
+    int64_t debited;         /* units of from */
+    int64_t credited;        /* units of to */
+    int64_t rate;            /* to per from, times RATE_SCALE */
+    uint64_t version;        /* rate table it came from */
+} FrameExchanged;
+
+/* a NUL-terminated copy of a fixed-size wire string */
+static void frame_str(char *out, const char *field, size_t size) {
+    memcpy(out, field, size);
+    out[size - 1] = '\0';
+}
+
+static int frame_currency(const char field[4]) {
+    char code[4];
+    frame_str(code, field, sizeof(code));
+    return parse_currency(code);
+}
+
+static void frame_balance(Session *sess, int cur, int64_t minor) {
+    FrameBalance b;
+    memset(&b, 0, sizeof(b));
+    memcpy(b.code, CUR_CODE(cur), 3);
+    b.minor = (int64_t)htole64((uint64_t)minor);
+    reply_bytes(sess, &b, sizeof(b));
+}
+
+static OpStatus frame_refuse(Session *sess, OpStatus st, const char *msg) {
+    reply(sess, msg);
+    return st;
+}
+
+/* run one request, writing its result payload; returns the status */
+static OpStatus frame_run(Session *sess, uint8_t op, const char *p, uint32_t len) {
+    char accid[ACCID_LEN], msg[64];
+    OpStatus st;
+
+    switch (op) {
+    case BIN_OP_TEXT: {
+        char line[FRAME_MAX + 1];
+        memcpy(line, p, len);
+        line[len] = '\0';
+        size_t at = session_pending(sess);
+        session_exec(sess, line);
+        return session_pending(sess) - at >= 3 &&
+               memcmp(sess->out + sess->outOff + at, "ERR", 3) == 0 ? OP_ERR : OP_OK;
+    }
+    case BIN_OP_BALANCES: {
+        FrameAccount r;
+        if (len != sizeof(r)) break;
+        memcpy(&r, p, sizeof(r));
+        frame_str(accid, r.acc, sizeof(accid));
+        Balance bal[ACC_CURRENCIES];
+        int n;
+        st = op_balances(sess->loggedUser, accid, bal, &n);
+        if (st != OP_OK) return frame_refuse(sess, st, OP_ERRORS[st]);
+        for (int k = 0; k < n; k++) frame_balance(sess, bal[k].cur, bal[k].minor);
+        return OP_OK;
+    }
+    case BIN_OP_DEPOSIT:
+    case BIN_OP_WITHDRAW: {
+        FrameMove r;
+        if (len != sizeof(r)) break;
+        memcpy(&r, p, sizeof(r));
+        frame_str(accid, r.acc, sizeof(accid));
+        int cur = frame_currency(r.code);
+        if (cur < 0) return frame_refuse(sess, OP_UNKNOWN_CURRENCY, OP_ERRORS[OP_UNKNOWN_CURRENCY]);
+        int64_t balance;
+        st = op_deposit_withdraw(sess->loggedUser, op == BIN_OP_DEPOSIT, accid, cur,
+                                 (int64_t)le64toh((uint64_t)r.amount), &balance);
+        if (st != OP_OK) return frame_refuse(sess, st, OP_ERRORS[st]);
+        frame_balance(sess, cur, balance);
+        return OP_OK;
+    }
+    case BIN_OP_EXCHANGE: {
+        FrameExchange r;
+        if (len != sizeof(r)) break;
+        memcpy(&r, p, sizeof(r));
+        frame_str(accid, r.acc, sizeof(accid));
+        int from = frame_currency(r.from), to = frame_currency(r.to);
+        if (from < 0 || to < 0)
+            return frame_refuse(sess, OP_UNKNOWN_CURRENCY, OP_ERRORS[OP_UNKNOWN_CURRENCY]);
+        int64_t amount = (int64_t)le64toh((uint64_t)r.amount), converted, rate;
+        uint64_t version;
+        st = op_exchange(sess->loggedUser, accid, from, to, amount, &converted, &rate, &version);
+        if (st != OP_OK)
+            return frame_refuse(sess, st, op_message(msg, sizeof(msg), st, from, to));
+        FrameExchanged x = {
+            (int64_t)htole64((uint64_t)amount), (int64_t)htole64((uint64_t)converted),
+            (int64_t)htole64((uint64_t)rate), htole64(version)
+        };
+        reply_bytes(sess, &x, sizeof(x));
+        return OP_OK;
+    }
+    case BIN_OP_TRANSFER: {
+        FrameTransfer r;
+        if (len != sizeof(r)) break;
+        memcpy(&r, p, sizeof(r));
+        char toAcc[ACCID_LEN];
+        frame_str(accid, r.from, sizeof(accid));
+        frame_str(toAcc, r.to, sizeof(toAcc));
+        int cur = frame_currency(r.code);
+        int toCur = r.toCode[0] ? frame_currency(r.toCode) : cur;
+        if (cur < 0 || toCur < 0)
+            return frame_refuse(sess, OP_UNKNOWN_CURRENCY, OP_ERRORS[OP_UNKNOWN_CURRENCY]);
+        int64_t amount = (int64_t)le64toh((uint64_t)r.amount), credited, rate;
+        uint64_t version;
+        st = op_transfer(sess->loggedUser, accid, toAcc, cur, toCur, amount,
+                         &credited, &rate, &version);
+        if (st != OP_OK)
+            return frame_refuse(sess, st, op_message(msg, sizeof(msg), st, cur, toCur));
+        FrameExchanged x = {
+            (int64_t)htole64((uint64_t)amount), (int64_t)htole64((uint64_t)credited),
+            (int64_t)htole64((uint64_t)rate), htole64(version)
+        };
+        reply_bytes(sess, &x, sizeof(x));
+        return OP_OK;
+    }
+    default:
+        return frame_refuse(sess, OP_ERR, "Unknown op");
+    }
+    return frame_refuse(sess, OP_ERR, "Bad frame length");
+}
+
+/* Run the next complete frame in the input buffer; 0 if there is none yet.
+ * The response header is written first and filled in once the payload is
+ * known. An oversized frame cannot be skipped reliably, so it ends the
+ * connection. */
+static int session_exec_frame(Session *sess) {
+    FrameHeader h;
+    size_t avail = sess->inLen - sess->inOff;
+    if (avail < sizeof(h)) return 0;
+    memcpy(&h, sess->in + sess->inOff, sizeof(h));
+    uint32_t len = le32toh(h.len);
+    if (len <= FRAME_MAX && avail < sizeof(h) + len) return 0;
+
+    out_reserve(sess, sizeof(h));
+    size_t at = session_pending(sess);
+    sess->outLen += sizeof(h);
+
+    OpStatus st;
+    if (len > FRAME_MAX) {
+        st = frame_refuse(sess, OP_ERR, "Frame too large");
+        sess->inOff = sess->inLen;
+        sess->quit = 1;
+    } else {
+        const char *payload = sess->in + sess->inOff + sizeof(h);
+        sess->inOff += sizeof(h) + len;
+        st = frame_run(sess, h.op, payload, len);
+    }
+
+    h.len = htole32((uint32_t)(session_pending(sess) - at - sizeof(h)));
+    h.status = (uint8_t)st;
+    h.reserved = 0;
+    memcpy(sess->out + sess->outOff + at, &h, sizeof(h));
+    return 1;
+}
+
+/* --------- buffered line reader ---------- */
+/* Input is read in IN_BUF_SIZE chunks and split with memchr; each command is
+ * handed to the dispatcher in place (its '\n' overwritten with '\0'), so
+ * pipelined lines that arrive in one segment cost one read() in total. */
+
+/* read once; returns -1 once the peer closed or failed, 0 otherwise
+ * (including EAGAIN on a non-blocking socket) */
+static int session_fill(Session *sess) {
+    if (sess->inOff > 0) {
+        memmove(sess->in, sess->in + sess->inOff, sess->inLen - sess->inOff);
+        sess->inLen -= sess->inOff;
+        sess->inOff = 0;
+    }
+    if (sess->inLen == sizeof(sess->in)) return 0;
+
+    while (1) {
+        ssize_t r = read(sess->fd, sess->in + sess->inLen, sizeof(sess->in) - sess->inLen);
+        if (r > 0) {
+            sess->inLen += (size_t)r;
+            return 0;
+        }
+        if (r == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+}
+
+/* Next buffered line, NUL-terminated in place, or NULL if none is complete.
+ * Lines longer than BUFFER_SIZE get *tooLong set and are skipped, even when
+ * they span several reads. */
+static char *session_next_line(Session *sess, int *tooLong) {
+    *tooLong = 0;
+    while (sess->inOff < sess->inLen) {
+        char *start = sess->in + sess->inOff;
+        size_t avail = sess->inLen - sess->inOff;
+        char *nl = memchr(start, '\n', avail);
+
+        if (!nl) {
+            if (avail >= BUFFER_SIZE || sess->discarding) {
+                /* no '\n' within the limit: report once, drop the rest */
+                *tooLong = !sess->discarding;
+                sess->discarding = 1;
+                sess->inOff = sess->inLen;
+            }
+            return NULL;
+        }
+
+        size_t len = (size_t)(nl - start) + 1;
+        sess->inOff += len;
+        if (sess->discarding) {
+            sess->discarding = 0;     /* tail of a line already rejected */
+            continue;
+        }
+        if (len > BUFFER_SIZE) {
+            *tooLong = 1;
+            return NULL;
+        }
+        *nl = '\0';
+        return start;
+    }
+    return NULL;
+}
+
+/* run every complete buffered line in order, prompting after each unless
+ * pipelining; pauses while replies are backed up. Returns the number of
+ * lines handled. */
+static unsigned long session_process_input(Session *sess) {
+    unsigned long lines = 0;
+    while (!sess->quit && session_pending(sess) < OUT_HIGH_WATER) {
+        if (sess->binary) {
+            if (!session_exec_frame(sess)) break;
+        } else {
+            int tooLong;
+            char *line = session_next_line(sess, &tooLong);
+            if (tooLong && sess->batching) {
+                batch_reject(sess, OP_ERR, "Line too long");
+            } else if (tooLong) {
+                reply(sess, "ERR Line too long\nEND\n");
+            } else if (line) {
+                session_exec(sess, line);
+            } else {
+                break;
+            }
+            if (!sess->quit && !sess->pipelined && !sess->binary)
+                reply(sess, "READY>\n");
+        }
+        if (t_commitLsn > sess->ackLsn) sess->ackLsn = t_commitLsn;
+        t_commitLsn = 0;
+        lines++;
+    }
+    return lines;
+}
+
+/* --------- fork-per-client handler ---------- */
+static void handleClient(int cfd) {
+    Session sess;
+    session_init(&sess, cfd);
+
+    /* Welcome block */
+    reply(&sess, WELCOME);
+    reply(&sess, "READY>\n");
+
+    while (!sess.quit) {
+        if (session_flush(&sess) == -1) break;
+        if (session_process_input(&sess) > 0) continue;
+        if (session_fill(&sess) == -1) break;
+    }
+    session_flush(&sess);
+
+    session_free(&sess);
+    close(cfd);
+    exit(EXIT_SUCCESS);
+}
+
+/* --------- epoll worker threads ---------- */
+/* Each worker multiplexes its share of the connections with non-blocking
+ * sockets. The byte stream each client sees is identical to the fork model. */
+/* replies are already coalesced into one send() per batch, so Nagle would
+ * only add delay waiting for the previous segment's ACK */
+static void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void set_nonblocking(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl == -1 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1) errMsg("fcntl O_NONBLOCK");
+}
+
+static void ack_unlink(Worker *w, Session *sess) {
+    if (sess->ackPrev) sess->ackPrev->ackNext = sess->ackNext;
+    else w->ackList = sess->ackNext;
+    if (sess->ackNext) sess->ackNext->ackPrev = sess->ackPrev;
+    sess->ackPrev = sess->ackNext = NULL;
+    sess->ackLsn = 0;
+    atomic_fetch_sub(&w->ackWaiting, 1);
+}
+
+/* 1 while the session's replies wait for the WAL; the session is then on
+ * ackList. Listing comes before the check so that the writer either sees
+ * ackWaiting or we see its new durable lsn. */
+static int session_held(Worker *w, Session *sess) {
+    if (sess->ackLsn == 0) return 0;
+    if (!sess->ackPrev && w->ackList != sess) {
+        sess->ackNext = w->ackList;
+        if (w->ackList) w->ackList->ackPrev = sess;
+        w->ackList = sess;
+        atomic_fetch_add(&w->ackWaiting, 1);
+    }
+    if (sess->ackLsn > atomic_load(&g_store->gc.durable)) return 1;
+    ack_unlink(w, sess);
+    return 0;
+}
+
+/* register the events the session waits for; none at all (not even
+ * EPOLLHUP) while it only waits for the WAL after its peer has gone */
+static void session_arm(Worker *w, Session *sess, unsigned want) {
+    if (want == sess->events) return;
+    struct epoll_event ev = { .events = want, .data.ptr = sess };
+    int op = want == 0 ? EPOLL_CTL_DEL : sess->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    epoll_ctl(w->ep, op, sess->fd, &ev);
+    sess->events = want;
+}
+
+static void session_close(Worker *w, Session *sess) {
+    if (sess->ackPrev || w->ackList == sess) ack_unlink(w, sess);
+    epoll_ctl(w->ep, EPOLL_CTL_DEL, sess->fd, NULL);
+    close(sess->fd);
+    session_free(sess);
+    free(sess);
+    atomic_fetch_sub(&w->active, 1);
+}
+
+/* flush, then re-arm epoll for what the session is waiting on. Replies
+ * held for the WAL stay buffered; a peer that closed meanwhile still gets
+ * them once they are durable. */
+static void session_update(Worker *w, Session *sess, int peerClosed) {
+    int rc = 0;
+    if (session_held(w, sess)) {
+        if (peerClosed) sess->quit = 1;
+    } else {
+        rc = session_flush(sess);
+        if (rc == -1 || peerClosed || (sess->quit && rc == 0)) {
+            session_close(w, sess);
+            return;
+        }
+    }
+
+    unsigned want = 0;
+    if (!sess->quit && session_pending(sess) < OUT_HIGH_WATER &&
+        sess->inLen - sess->inOff < sizeof(sess->in)) want |= EPOLLIN;
+    if (rc == 1) want |= EPOLLOUT;
+    session_arm(w, sess, want);
+}
+
+/* run the buffered commands, then flush and re-arm */
+static void session_run(Worker *w, Session *sess, int peerClosed) {
+    atomic_fetch_add(&w->commands, session_process_input(sess));
+    /* processing pauses at the high-water mark; if the socket took
+       the whole backlog at once, carry on here, because lines that
+       are already buffered will not raise another EPOLLIN */
+    while (!sess->quit && session_pending(sess) >= OUT_HIGH_WATER &&
+           !session_held(w, sess) && session_flush(sess) == 0)
+        atomic_fetch_add(&w->commands, session_process_input(sess));
+    session_update(w, sess, peerClosed);
+}
+
+/* --------- io_uring worker threads ---------- */
+/* --io uring: the same sessions and command handling, but every accept,
+ * recv and send is an io_uring request. Whatever a batch of completions
+ * queues up goes to the kernel with the next wait, in one io_uring_enter,
+ * so a busy worker makes about one syscall per batch rather than a few per
+ * command. A send owns its buffer until it completes (replies produced
+ * meanwhile start a new one), and recv writes behind inLen only. */
+#define URING_ACCEPT 1
+#define URING_ACK 2
+#define URING_SEND 1u            /* low bit of a session's user_data */
+
+static void uring_recv(Worker *w, Session *sess) {
+    if (sess->inOff > 0) {
+        memmove(sess->in, sess->in + sess->inOff, sess->inLen - sess->inOff);
+        sess->inLen -= sess->inOff;
+        sess->inOff = 0;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sess->fd;
+    sqe->addr = (uintptr_t)(sess->in + sess->inLen);
+    sqe->len = (unsigned)(sizeof(sess->in) - sess->inLen);
+    sqe->user_data = (uintptr_t)sess;
+    sess->events |= EPOLLIN;
+}
+
+static void uring_send(Worker *w, Session *sess) {
+    if (!sess->sending) {
+        /* take over out; new replies go to a fresh buffer */
+        sess->sending = sess->out;
+        sess->sendOff = sess->outOff;
+        sess->sendLen = sess->outLen;
+        sess->sendCap = sess->outCap;
+        sess->out = NULL;
+        sess->outOff = sess->outLen = sess->outCap = 0;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sess->fd;
+    sqe->addr = (uintptr_t)(sess->sending + sess->sendOff);
+    sqe->len = (unsigned)(sess->sendLen - sess->sendOff);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)sess | URING_SEND;
+    sess->events |= EPOLLOUT;
+}
+
+/* a send completed: the rest of the buffer, or recycle it */
+static void uring_sent(Worker *w, Session *sess, int res) {
+    sess->sendOff += (size_t)res;
+    if (sess->sendOff < sess->sendLen) {
+        uring_send(w, sess);
+        return;
+    }
+    if (!sess->out && sess->sendCap <= OUT_KEEP) {
+        sess->out = sess->sending;
+        sess->outCap = sess->sendCap;
+    } else {
+        free(sess->sending);
+    }
+    sess->sending = NULL;
+}
+
+/* fd -1 marks a closed session still waiting for its requests to finish;
+ * shutdown() makes them complete promptly */
+static void uring_close(Worker *w, Session *sess) {
+    if (sess->ackPrev || w->ackList == sess) ack_unlink(w, sess);
+    if (sess->fd != -1) {
+        if (sess->events) shutdown(sess->fd, SHUT_RDWR);
+        close(sess->fd);
+        sess->fd = -1;
+        atomic_fetch_sub(&w->active, 1);
+    }
+    if (sess->events == 0) {
+        session_free(sess);
+        free(sess);
+    }
+}
+
+/* queue the send and recv the session is ready for, or close it */
+static void uring_update(Worker *w, Session *sess, int peerClosed) {
+    if (peerClosed) sess->quit = 1;
+    int held = session_held(w, sess);
+    if (!held && !(sess->events & EPOLLOUT) && session_pending(sess) > 0)
+        uring_send(w, sess);
+    if (sess->quit && !held && !(sess->events & EPOLLOUT)) {
+        uring_close(w, sess);
+        return;
+    }
+    if (!sess->quit && !(sess->events & EPOLLIN) && session_pending(sess) < OUT_HIGH_WATER &&
+        sess->inLen - sess->inOff < sizeof(sess->in))
+        uring_recv(w, sess);
+}
+
+static void uring_run(Worker *w, Session *sess, int peerClosed) {
+    atomic_fetch_add(&w->commands, session_process_input(sess));
+    uring_update(w, sess, peerClosed);
+}
+
+/* --------- worker loops ---------- */
+/* the writer made more of the WAL durable: release the sessions it covers */
+static void acks_release(Worker *w) {
+    long long durable = atomic_load(&g_store->gc.durable);
+    Session *sess = w->ackList;
+    while (sess) {
+        Session *next = sess->ackNext;
+        if (sess->ackLsn <= durable) {
+            if (g_cfg.io == IO_URING) uring_run(w, sess, 0);
+            else session_run(w, sess, 0);
+        }
+        sess = next;
+    }
+}
+
+static void accept_clients(Worker *w) {
+    while (1) {
+        int cfd = accept(w->lfd, NULL, NULL);
+        if (cfd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        set_nonblocking(cfd);
+        set_nodelay(cfd);
 
-    printf("Server listening on port %d\n", PORT);
+        Session *sess = malloc(sizeof(*sess));
+        if (!sess) {
+            close(cfd);
+            continue;
+        }
+        session_init(sess, cfd);
+        sess->events = EPOLLIN;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = sess };
+        if (epoll_ctl(w->ep, EPOLL_CTL_ADD, cfd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(cfd);
+            free(sess);
+            continue;
+        }
+        atomic_fetch_add(&w->accepted, 1);
+        atomic_fetch_add(&w->active, 1);
+
+        reply(sess, WELCOME);
+        reply(sess, "READY>\n");
+        session_update(w, sess, 0);
+    }
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+
+    w->ep = epoll_create1(0);
+    if (w->ep == -1) errMsg("epoll_create1");
+
+    set_nonblocking(w->lfd);
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(w->ep, EPOLL_CTL_ADD, w->lfd, &lev) == -1) errMsg("epoll_ctl");
+    struct epoll_event aev = { .events = EPOLLIN, .data.ptr = &w->efd };
+    if (epoll_ctl(w->ep, EPOLL_CTL_ADD, w->efd, &aev) == -1) errMsg("epoll_ctl");
+
+    struct epoll_event evs[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(w->ep, evs, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            errMsg("epoll_wait");
+        }
+
+        int acks = 0;
+        for (int i = 0; i < n; i++) {
+            Session *sess = evs[i].data.ptr;
+            if (!sess) {
+                accept_clients(w);
+                continue;
+            }
+            if (evs[i].data.ptr == &w->efd) {
+                acks = 1;
+                continue;
+            }
+
+            int peerClosed = 0;
+            if ((evs[i].events & EPOLLOUT) && !session_held(w, sess))
+                session_flush(sess);
+            if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                peerClosed = (session_fill(sess) == -1);
+            session_run(w, sess, peerClosed);
+        }
+
+        /* after the batch: releasing may close sessions that still had
+           events in it */
+        if (acks) {
+            uint64_t cnt;
+            if (read(w->efd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+                errMsg("read eventfd");
+            acks_release(w);
+        }
+    }
+    return NULL;
+}
+
+static void uring_accept(Worker *w) {
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->lfd;
+    sqe->user_data = URING_ACCEPT;
+}
+
+static void uring_ack_wait(Worker *w) {
+    struct io_uring_sqe *sqe = uring_sqe(&w->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = w->efd;
+    sqe->addr = (uintptr_t)&w->efdCount;
+    sqe->len = sizeof(w->efdCount);
+    sqe->user_data = URING_ACK;
+}
+
+static void uring_complete(Worker *w, const struct io_uring_cqe *cqe) {
+    if (cqe->user_data == URING_ACCEPT) {
+        if (cqe->res >= 0) {
+            Session *sess = malloc(sizeof(*sess));
+            if (!sess) {
+                close(cqe->res);
+            } else {
+                set_nodelay(cqe->res);
+                session_init(sess, cqe->res);
+                atomic_fetch_add(&w->accepted, 1);
+                atomic_fetch_add(&w->active, 1);
+                reply(sess, WELCOME);
+                reply(sess, "READY>\n");
+                uring_update(w, sess, 0);
+            }
+        } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        }
+        uring_accept(w);
+        return;
+    }
+    if (cqe->user_data == URING_ACK) {
+        uring_ack_wait(w);
+        acks_release(w);
+        return;
+    }
+
+    Session *sess = (Session *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_SEND);
+    int isSend = (cqe->user_data & URING_SEND) != 0;
+    sess->events &= ~(unsigned)(isSend ? EPOLLOUT : EPOLLIN);
+    if (sess->fd == -1) {
+        uring_close(w, sess);            /* free once the last one is back */
+        return;
+    }
+
+    int peerClosed = 0;
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        if (isSend) uring_send(w, sess);
+    } else if (isSend) {
+        if (cqe->res < 0) {
+            uring_close(w, sess);
+            return;
+        }
+        uring_sent(w, sess, cqe->res);
+    } else if (cqe->res > 0) {
+        sess->inLen += (size_t)cqe->res;
+    } else {
+        peerClosed = 1;
+    }
+    uring_run(w, sess, peerClosed);
+}
+
+static void *uring_worker_main(void *arg) {
+    Worker *w = arg;
+    uring_accept(w);
+    uring_ack_wait(w);
+    while (1) {
+        uring_submit(&w->ring, 1);
+        struct io_uring_cqe cqe;
+        while (uring_cqe(&w->ring, &cqe)) uring_complete(w, &cqe);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--io epoll|uring|fork] [--threads N] [--backlog N]\n"
+            "          [--persist wal|snapshot|mmap] [--checkpoint-every N]\n"
+            "          [--commit-window-us N] [--commit-batch N] [--store-gb N]\n"
+            "          [--format text|binary] [--convert text|binary]\n"
+            "          [--rounding half-even|half-up|down] [--rates FILE]\n"
+            "          [--rate-feed PATH] [--durability strict|relaxed]\n"
+            "  --io epoll           serve all clients from one event loop (default)\n"
+            "  --io uring           the same with io_uring requests instead of epoll\n"
+            "                       (falls back to epoll where io_uring is unavailable)\n"
+            "  --io fork            fork one process per client (legacy)\n"
+            "  --threads N          worker threads (default: one per CPU)\n"
+            "  --backlog N          listen() backlog per socket (default SOMAXCONN)\n"
+            "  --persist wal        append each mutation to " WAL_FILE " (default)\n"
+            "  --persist snapshot   rewrite " DB_FILE " after every mutation\n"
+            "  --persist mmap       write records through to a shared mapping of " BIN_FILE ",\n"
+            "                       msync'ed at commit (implies --format binary)\n"
+            "  --checkpoint-every N fold the WAL into " DB_FILE " every N records (default 1000)\n"
+            "  --commit-window-us N let the WAL writer wait up to N us for more records (default 0)\n"
+            "  --commit-batch N     ...but flush as soon as N records are pending (default 64)\n"
+            "  --durability strict  reply to a mutation once its WAL record is on disk (default)\n"
+            "  --durability relaxed reply as soon as it is applied in memory and queued\n"
+            "  --store-gb N         address space reserved for users and accounts (default 64)\n"
+            "  --format text        keep the snapshot in " DB_FILE " (default)\n"
+            "  --format binary      keep it in " BIN_FILE ", updating records in place\n"
+            "  --convert FMT        rewrite the data in format FMT (from the other one) and exit\n"
+            "  --rounding MODE      how exchange results and amounts finer than a cent are\n"
+            "                       rounded: half-even (default), half-up or down\n"
+            "  --rates FILE         read exchange rates from FILE (default: 1 EUR =\n"
+            "                       1.10 USD = 0.85 GBP)\n"
+            "  --rate-feed PATH     accept live rate updates on UNIX socket PATH\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_args(int argc, char *argv[]) {
+    static const struct option opts[] = {
+        { "io",               required_argument, NULL, 'i' },
+        { "threads",          required_argument, NULL, 't' },
+        { "backlog",          required_argument, NULL, 'l' },
+        { "persist",          required_argument, NULL, 'p' },
+        { "checkpoint-every", required_argument, NULL, 'c' },
+        { "commit-window-us", required_argument, NULL, 'w' },
+        { "commit-batch",     required_argument, NULL, 'b' },
+        { "durability",       required_argument, NULL, 'd' },
+        { "store-gb",         required_argument, NULL, 's' },
+        { "format",           required_argument, NULL, 'f' },
+        { "convert",          required_argument, NULL, 'C' },
+        { "rounding",         required_argument, NULL, 'r' },
+        { "rates",            required_argument, NULL, 'R' },
+        { "rate-feed",        required_argument, NULL, 'F' },
+        { "help",             no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int o;
+    while ((o = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+        switch (o) {
+        case 'i':
+            if (strcmp(optarg, "epoll") == 0) g_cfg.io = IO_EPOLL;
+            else if (strcmp(optarg, "fork") == 0) g_cfg.io = IO_FORK;
+            else if (strcmp(optarg, "uring") == 0) g_cfg.io = IO_URING;
+            else usage(argv[0]);
+            break;
+        case 't':
+            g_cfg.threads = atoi(optarg);
+            if (g_cfg.threads < 1) usage(argv[0]);
+            break;
+        case 'l':
+            g_cfg.backlog = atoi(optarg);
+            if (g_cfg.backlog < 1) usage(argv[0]);
+            break;
+        case 'p':
+            if (strcmp(optarg, "wal") == 0) g_cfg.persist = PERSIST_WAL;
+            else if (strcmp(optarg, "snapshot") == 0) g_cfg.persist = PERSIST_SNAPSHOT;
+            else if (strcmp(optarg, "mmap") == 0) g_cfg.persist = PERSIST_MMAP;
+            else usage(argv[0]);
+            break;
+        case 'c':
+            g_cfg.checkpointEvery = atol(optarg);
+            if (g_cfg.checkpointEvery < 1) usage(argv[0]);
+            break;
+        case 'w':
+            g_cfg.commitWindowUs = atol(optarg);
+            if (g_cfg.commitWindowUs < 0) usage(argv[0]);
+            break;
+        case 'b':
+            g_cfg.commitBatch = atol(optarg);
+            if (g_cfg.commitBatch < 1) usage(argv[0]);
+            break;
+        case 'd':
+            if (strcmp(optarg, "strict") == 0) g_cfg.durability = DURABILITY_STRICT;
+            else if (strcmp(optarg, "relaxed") == 0) g_cfg.durability = DURABILITY_RELAXED;
+            else usage(argv[0]);
+            break;
+        case 's':
+            g_cfg.storeGb = atol(optarg);
+            if (g_cfg.storeGb < 1) usage(argv[0]);
+            break;
+        case 'f':
+        case 'C': {
+            int f;
+            if (strcmp(optarg, "text") == 0) f = FORMAT_TEXT;
+            else if (strcmp(optarg, "binary") == 0) f = FORMAT_BINARY;
+            else usage(argv[0]);
+            if (o == 'f') g_cfg.format = (DbFormat)f;
+            else g_cfg.convertTo = f;
+            break;
+        }
+        case 'r':
+            if (strcmp(optarg, "half-even") == 0) g_cfg.rounding = ROUND_HALF_EVEN;
+            else if (strcmp(optarg, "half-up") == 0) g_cfg.rounding = ROUND_HALF_UP;
+            else if (strcmp(optarg, "down") == 0) g_cfg.rounding = ROUND_DOWN;
+            else usage(argv[0]);
+            break;
+        case 'R':
+            g_cfg.ratesFile = optarg;
+            break;
+        case 'F':
+            g_cfg.rateFeed = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) usage(argv[0]);
+    if (g_cfg.persist == PERSIST_MMAP) g_cfg.format = FORMAT_BINARY;
+}
+
+/* legacy model: one child process per connection */
+static void fork_loop(int lfd) {
+    struct sockaddr_in client_addr;
+    socklen_t addrlen = sizeof(client_addr);
+    pid_t parent = getpid();
 
     while (1) {
-        cfd = accept(lfd, (struct sockaddr *)&client_addr, &addrlen);
+        int cfd = accept(lfd, (struct sockaddr *)&client_addr, &addrlen);
         if (cfd == -1) {
             if (errno == EINTR) continue;
             perror("accept");
@@ -775,9 +4598,14 @@ int main() {
         }
 
         if (pid == 0) {
-            /* child */
+            /* child: die with the parent, whose WAL writer would never
+               flush our records (strict replies would hang forever) */
+            if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1 || getppid() != parent) _exit(EXIT_FAILURE);
             close(lfd);
-            handleClient(cfd, dbfd);
+            close(g_portfd);   /* a restart must not wait for us to die */
+            epoch_claim_slot();  /* don't share the parent's epoch counters */
+            set_nodelay(cfd);
+            handleClient(cfd);
         } else {
             /* parent */
             close(cfd);
@@ -786,8 +4614,155 @@ int main() {
             while (waitpid(-1, NULL, WNOHANG) > 0) { }
         }
     }
+}
+
+/* Refuse to start next to another server on PORT. The worker sockets use
+ * SO_REUSEPORT, so a second instance would bind them without an error and
+ * share the port (and the data files). Hold an abstract unix socket named
+ * after the port for the life of the process (two instances starting
+ * together can't both get it), then check that nothing else listens there
+ * with a plain bind. Runs before the DB is loaded. */
+static void port_claim(void) {
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    int len = snprintf(un.sun_path + 1, sizeof(un.sun_path) - 1,
+                       "exchange-server:%d", PORT);
+    g_portfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (g_portfd == -1) errMsg("socket");
+    if (bind(g_portfd, (struct sockaddr *)&un,
+             (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len)) == -1) {
+        if (errno == EADDRINUSE) {
+            fprintf(stderr, "port %d: another server is already running\n", PORT);
+            exit(EXIT_FAILURE);
+        }
+        errMsg("bind");
+    }
+    /* g_portfd stays open: it is the lock */
+
+    struct sockaddr_in in;
+    int reuse = 1;
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = INADDR_ANY;
+    in.sin_port = htons(PORT);
+    int pfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (pfd == -1) errMsg("socket");
+    if (setsockopt(pfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
+        errMsg("setsockopt");
+    if (bind(pfd, (struct sockaddr *)&in, sizeof(in)) == -1) {
+        if (errno == EADDRINUSE) {
+            fprintf(stderr, "port %d is already in use\n", PORT);
+            exit(EXIT_FAILURE);
+        }
+        errMsg("bind");
+    }
+    close(pfd);
+}
+
+static int open_listener(int reuseport) {
+    struct sockaddr_in serv_addr;
+    int reuse = 1;
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd == -1) errMsg("socket");
+
+    if (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
+        errMsg("setsockopt");
+    if (reuseport &&
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+        errMsg("setsockopt SO_REUSEPORT");
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(PORT);
+
+    if (bind(lfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1)
+        errMsg("bind");
+
+    if (listen(lfd, g_cfg.backlog) == -1)
+        errMsg("listen");
+
+    return lfd;
+}
+
+/* bind every worker's socket up front so a busy port fails at startup,
+ * then run the workers (epoll or io_uring) until the process is killed */
+static void run_workers(void) {
+    g_workerCount = g_cfg.threads;
+    if (g_workerCount < 1) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        g_workerCount = cpus > 0 ? (int)cpus : 1;
+    }
+
+    g_workers = calloc((size_t)g_workerCount, sizeof(Worker));
+    if (!g_workers) errMsg("calloc");
+    for (int i = 0; g_cfg.io == IO_URING && i < g_workerCount; i++) {
+        if (uring_init(&g_workers[i].ring, URING_ENTRIES, URING_CQ_ENTRIES) == -1) {
+            /* no io_uring here (old kernel, seccomp, sysctl): use epoll */
+            fprintf(stderr, "io_uring unavailable (%s), falling back to epoll\n",
+                    strerror(errno));
+            while (i-- > 0) close(g_workers[i].ring.fd);
+            g_cfg.io = IO_EPOLL;
+        }
+    }
+    for (int i = 0; i < g_workerCount; i++) {
+        g_workers[i].id = i;
+        g_workers[i].lfd = open_listener(1);
+        /* io_uring reads it as a request, so it must block */
+        g_workers[i].efd = eventfd(0, g_cfg.io == IO_URING ? 0 : EFD_NONBLOCK);
+        if (g_workers[i].efd == -1) errMsg("eventfd");
+    }
+    wal_writer_start();
+
+    printf("Server listening on port %d (%d %s worker%s)\n", PORT, g_workerCount,
+           g_cfg.io == IO_URING ? "io_uring" : "epoll", g_workerCount == 1 ? "" : "s");
+    fflush(stdout);
+
+    for (int i = 0; i < g_workerCount; i++) {
+        if (pthread_create(&g_workers[i].thread, NULL,
+                           g_cfg.io == IO_URING ? uring_worker_main : worker_main,
+                           &g_workers[i]) != 0)
+            errMsg("pthread_create");
+    }
+    for (int i = 0; i < g_workerCount; i++)
+        pthread_join(g_workers[i].thread, NULL);
+}
+
+int main(int argc, char *argv[]) {
+    commands_check();
+    parse_args(argc, argv);
+
+    /* a client vanishing mid-reply must not kill the (shared) server process */
+    signal(SIGPIPE, SIG_IGN);
+    currencies_init();
+
+    if (g_cfg.convertTo != -1) {
+        convert_db((DbFormat)g_cfg.convertTo);
+        return 0;
+    }
+
+    port_claim();
+
+    /* load the DB once into shared memory; children inherit the mapping */
+    store_create();
+    rates_create();
+    if (g_cfg.rateFeed) rate_feed_start(g_cfg.rateFeed);
+
+    /* seed rand for account IDs */
+    srand((unsigned) getpid());
+
+    if (g_cfg.io == IO_FORK) {
+        int lfd = open_listener(0);
+        printf("Server listening on port %d (fork per client)\n", PORT);
+        wal_writer_start();
+        fork_loop(lfd);
+        close(lfd);
+    } else {
+        run_workers();
+    }
 
-    close(dbfd);
-    close(lfd);
+    close(g_walfd);
     return 0;
 }
@@ -0,0 +1,125 @@
+/* Fuzz target for amount_parse(). The first input byte picks a currency
+ * (and so its number of decimals); the rest is the amount text. With
+ * libFuzzer:
+ *
+ *   clang -g -O1 -fsanitize=fuzzer,address -pthread tests/amount_fuzz.c -o amount_fuzz
+ *   ./amount_fuzz -max_len=48
+ *
+ * Without it, -DFUZZ_STANDALONE adds a main that replays the files named on
+ * the command line, or with none runs a million random inputs drawn from
+ * the characters an amount is made of:
+ *
+ *   gcc -g -O1 -fsanitize=address,undefined -DFUZZ_STANDALONE -pthread \
+ *       tests/amount_fuzz.c -o amount_fuzz && ./amount_fuzz
+ *
+ * Any broken property aborts. */
+#include <ctype.h>
+
+#define main server_main
+#include "../server.c"
+#undef main
+
+/* The slow, obvious version: is s [+-]digits[.digits] (-1 if not), how
+ * many digits follow the point, and its value in minor units, saturated
+ * just past MONEY_MAX. */
+static int amount_reference(const char *s, int digits, int *places, int64_t *out) {
+    int neg = (*s == '-');
+    if (*s == '+' || *s == '-') s++;
+    if (!isdigit((unsigned char)*s)) return -1;
+    unsigned __int128 v = 0;
+    for (; isdigit((unsigned char)*s); s++) {
+        v = v * 10 + (unsigned)(*s - '0');
+        if (v > MONEY_MAX) v = (unsigned __int128)MONEY_MAX + 1;
+    }
+    *places = 0;
+    if (*s == '.') {
+        s++;
+        if (!isdigit((unsigned char)*s)) return -1;
+        for (; isdigit((unsigned char)*s); s++) {
+            if (++*places <= digits) v = v * 10 + (unsigned)(*s - '0');
+            if (v > MONEY_MAX) v = (unsigned __int128)MONEY_MAX + 1;
+        }
+    }
+    if (*s != '\0') return -1;
+    for (int i = *places; i < digits; i++) {
+        v *= 10;
+        if (v > MONEY_MAX) v = (unsigned __int128)MONEY_MAX + 1;
+    }
+    *out = neg ? -(int64_t)v : (int64_t)v;
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) return 0;
+    int digits = CUR_DIGITS(data[0] % CUR_MAX);
+
+    /* exactly sized copy, so ASan catches a read past the terminator */
+    char *s = malloc(size);
+    if (!s) abort();
+    memcpy(s, data + 1, size - 1);
+    s[size - 1] = '\0';
+
+    int64_t v = 0, want = 0;
+    int places = 0, rc = amount_parse(s, digits, &v);
+    int ok = amount_reference(s, digits, &places, &want) == 0;
+    int inRange = want <= MONEY_MAX && want >= -MONEY_MAX;
+    if (rc == 0) {
+        /* exactly the reference value, and formatting it gives it back */
+        if (!ok || places > digits || v != want) abort();
+        char buf[MONEY_STR];
+        int64_t back = 0;
+        if (amount_parse(fmt_fixed(buf, v, digits), digits, &back) != 0 || back != v) abort();
+    } else if (rc == -2) {
+        if (!ok || places <= digits) abort();
+    } else if (rc == -1) {
+        /* malformed, or beyond MONEY_MAX */
+        if (ok && places <= digits && inRange) abort();
+    } else {
+        abort();
+    }
+    free(s);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char *argv[]) {
+    uint8_t buf[64];
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            FILE *f = fopen(argv[i], "rb");
+            if (!f) errMsg(argv[i]);
+            size_t n = fread(buf, 1, sizeof(buf), f);
+            fclose(f);
+            LLVMFuzzerTestOneInput(buf, n);
+        }
+        return 0;
+    }
+
+    /* half the inputs are random strings over the characters an amount is
+       made of; the rest are near-amounts: [+-]digits[.digits] with long
+       runs of digits, now and then with one character replaced */
+    static const char alphabet[] = "0123456789000999.+- \t\nex";
+    srand(1);
+    for (int iter = 0; iter < 1000000; iter++) {
+        size_t n = 1;
+        buf[0] = (uint8_t)rand();
+        if (iter & 1) {
+            n += (size_t)(rand() % 40);
+            for (size_t i = 1; i < n; i++)
+                buf[i] = (uint8_t)alphabet[rand() % (sizeof(alphabet) - 1)];
+        } else {
+            int r = rand() % 4;
+            if (r < 2) buf[n++] = r ? '-' : '+';
+            for (int k = 1 + rand() % 24; k > 0; k--) buf[n++] = (uint8_t)('0' + rand() % 10);
+            if (rand() % 2) {
+                buf[n++] = '.';
+                for (int k = 1 + rand() % 6; k > 0; k--) buf[n++] = (uint8_t)('0' + rand() % 10);
+            }
+            if (rand() % 8 == 0) buf[1 + rand() % (n - 1)] = (uint8_t)alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+    printf("1000000 inputs, no failures\n");
+    return 0;
+}
+#endif
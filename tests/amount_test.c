@@ -0,0 +1,100 @@
+/* Table-driven test of amount_parse(), the parser every client amount goes
+ * through. server.c is compiled in with its main renamed:
+ *
+ *   gcc -Wall -Wextra -O2 -pthread tests/amount_test.c -o amount_test && ./amount_test
+ *
+ * Exit status is the number of failed cases. */
+#define main server_main
+#include "../server.c"
+#undef main
+
+typedef struct {
+    const char *cur;
+    const char *in;
+    int rc;                  /* 0, -1 malformed/out of range, -2 too many decimals */
+    int64_t want;            /* minor units when rc == 0 */
+} AmountCase;
+
+static const AmountCase CASES[] = {
+    /* plain amounts, scaled to the currency's minor unit */
+    { "USD", "12.34", 0, 1234 },
+    { "USD", "12", 0, 1200 },
+    { "USD", "0.5", 0, 50 },
+    { "USD", "007.50", 0, 750 },
+    { "USD", "0", 0, 0 },
+
+    /* sign: accepted here, positivity is checked by the operations */
+    { "USD", "+5", 0, 500 },
+    { "USD", "-5", 0, -500 },
+    { "USD", "-", -1, 0 },
+    { "USD", "+", -1, 0 },
+    { "USD", "+-1", -1, 0 },
+    { "USD", "--1", -1, 0 },
+    { "USD", "1-", -1, 0 },
+
+    /* whitespace is the tokenizer's business, never part of an amount */
+    { "USD", " 1", -1, 0 },
+    { "USD", "1 ", -1, 0 },
+    { "USD", "\t1", -1, 0 },
+    { "USD", "1\n", -1, 0 },
+    { "USD", "1 000", -1, 0 },
+    { "USD", "- 1", -1, 0 },
+
+    /* malformed */
+    { "USD", "", -1, 0 },
+    { "USD", ".5", -1, 0 },
+    { "USD", "1.", -1, 0 },
+    { "USD", "1.2.3", -1, 0 },
+    { "USD", "1e3", -1, 0 },
+    { "USD", "1E3", -1, 0 },
+    { "USD", "nan", -1, 0 },
+    { "USD", "inf", -1, 0 },
+    { "USD", "0x10", -1, 0 },
+    { "USD", "1,5", -1, 0 },
+    { "USD", "1.005x", -1, 0 },   /* malformed wins over too many decimals */
+
+    /* fraction digits per currency: USD 2, JPY 0, KWD 3 */
+    { "USD", "1.005", -2, 0 },
+    { "USD", "1.000", -2, 0 },
+    { "JPY", "100", 0, 100 },
+    { "JPY", "100.0", -2, 0 },
+    { "JPY", "1.5", -2, 0 },
+    { "KWD", "1.234", 0, 1234 },
+    { "KWD", "0.001", 0, 1 },
+    { "KWD", "1.5", 0, 1500 },
+    { "KWD", "1.2345", -2, 0 },
+    { "KWD", "0.0001", -2, 0 },
+
+    /* overflow: MONEY_MAX (10^18 minor units) is the largest magnitude */
+    { "USD", "10000000000000000", 0, MONEY_MAX },
+    { "USD", "-10000000000000000", 0, -MONEY_MAX },
+    { "USD", "10000000000000000.01", -1, 0 },
+    { "USD", "10000000000000001", -1, 0 },
+    { "USD", "1000000000000000000", -1, 0 },
+    { "USD", "18446744073709551617", -1, 0 },   /* 2^64 + 1: no wraparound */
+    { "USD", "99999999999999999999999999999", -1, 0 },
+    { "JPY", "1000000000000000000", 0, MONEY_MAX },
+    { "JPY", "1000000000000000001", -1, 0 },
+    { "KWD", "1000000000000000", 0, MONEY_MAX },
+    { "KWD", "1000000000000000.001", -1, 0 },
+    { "KWD", "1000000000000001", -1, 0 },
+    { "USD", "000000000000000000000000000001.25", 0, 125 },
+};
+
+int main(void) {
+    currencies_init();
+    int failed = 0, n = (int)(sizeof(CASES) / sizeof(CASES[0]));
+    for (int i = 0; i < n; i++) {
+        const AmountCase *t = &CASES[i];
+        int cur = parse_currency(t->cur);
+        int64_t v = 0;
+        int rc = amount_parse(t->in, CUR_DIGITS(cur), &v);
+        if (rc != t->rc || (rc == 0 && v != t->want)) {
+            printf("FAIL %s \"%s\": got %d/%lld, want %d/%lld\n", t->cur, t->in,
+                   rc, (long long)v, t->rc, (long long)t->want);
+            failed++;
+        }
+    }
+    printf("%d of %d cases passed\n", n - failed, n);
+    return failed;
+}
@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""Crash-recovery test: SIGKILL the server while clients are writing,
+restart it on the same files and check what it replays.
+
+    gcc -O2 -pthread server.c -o server
+    python3 tests/crash_recovery.py ./server
+
+Each persistence setup runs in a fresh directory for a few rounds. In every
+round, one client per account deposits 1.00 USD in a loop, and, where
+TRANSFER is available, another moves money back and forth between two
+accounts of its own. The server is killed at a random moment, restarted,
+and must come back with:
+
+  - every acknowledged deposit, and none that was never sent:
+    acked <= balance <= sent for each account
+  - the two transfer accounts still adding up to what was put in, so no
+    transfer is half applied
+
+The server listens on port 8080, which must be free. Exit status is 0 when
+every round of every setup passes.
+"""
+import os
+import random
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+PORT = 8080
+DEPOSITORS = 8
+ROUNDS = 3
+TRANSFER_FUNDS = 100000  # cents, split over the two transfer accounts
+
+SETUPS = [
+    ("wal", [], True),
+    ("wal, binary snapshot", ["--format", "binary"], True),
+    ("wal, fork per client", ["--io", "fork"], True),
+    ("wal, small checkpoints", ["--checkpoint-every", "50"], True),
+    ("mmap", ["--persist", "mmap"], False),
+]
+
+
+class Conn:
+    def __init__(self):
+        self.sock = socket.create_connection(("127.0.0.1", PORT))
+        self.file = self.sock.makefile("rb")
+        self.read_reply()
+
+    def read_reply(self):
+        out = []
+        while True:
+            line = self.file.readline().decode()
+            if not line:
+                raise ConnectionError("server went away")
+            if line == "READY>\n":
+                continue
+            if line == "END\n":
+                return "".join(out)
+            out.append(line)
+
+    def cmd(self, line):
+        self.sock.sendall((line + "\n").encode())
+        return self.read_reply()
+
+    def close(self):
+        self.sock.close()
+
+
+def start(server, args, cwd):
+    proc = subprocess.Popen([server] + args, cwd=cwd, stdout=subprocess.DEVNULL)
+    for _ in range(100):
+        try:
+            Conn().close()
+            return proc
+        except OSError:
+            time.sleep(0.05)
+    proc.kill()
+    raise RuntimeError("server did not start")
+
+
+def usd_cents(conn, acc):
+    reply = conn.cmd("BALANCES " + acc)
+    units, cents = reply.split("USD=")[1].split()[0].split(".")
+    return int(units) * 100 + int(cents)
+
+
+def deposit_loop(acc, counts, i):
+    try:
+        conn = Conn()
+        conn.cmd("LOGIN u pw")
+        while True:
+            counts[i][0] += 1
+            if not conn.cmd("DEPOSIT %s USD 1" % acc).startswith("OK"):
+                return
+            counts[i][1] += 1
+    except (OSError, ConnectionError):
+        pass
+
+
+def transfer_loop(a, b):
+    try:
+        conn = Conn()
+        conn.cmd("LOGIN t pw")
+        while True:
+            conn.cmd("TRANSFER %s %s USD %d.%02d" % (a, b, *divmod(random.randint(1, 5000), 100)))
+            a, b = b, a
+    except (OSError, ConnectionError):
+        pass
+
+
+def run_setup(server, name, args, transfers):
+    work = tempfile.mkdtemp(prefix="crash_recovery.")
+    ok = True
+    try:
+        proc = start(server, args, work)
+        conn = Conn()
+        conn.cmd("REGISTER u pw")
+        conn.cmd("REGISTER t pw")
+        conn.cmd("LOGIN u pw")
+        accs = [conn.cmd("CREATE_ACCOUNT IND u").split()[2] for _ in range(DEPOSITORS)]
+        conn.cmd("LOGIN t pw")
+        pair = [conn.cmd("CREATE_ACCOUNT IND t").split()[2] for _ in range(2)]
+        if transfers:
+            conn.cmd("DEPOSIT %s USD %d" % (pair[0], TRANSFER_FUNDS // 100))
+        conn.close()
+
+        base = [0] * DEPOSITORS
+        for rnd in range(1, ROUNDS + 1):
+            counts = [[0, 0] for _ in accs]  # sent, acknowledged
+            threads = [threading.Thread(target=deposit_loop, args=(acc, counts, i))
+                       for i, acc in enumerate(accs)]
+            if transfers:
+                threads.append(threading.Thread(target=transfer_loop, args=tuple(pair)))
+            for t in threads:
+                t.start()
+            time.sleep(random.uniform(0.2, 0.8))
+            proc.send_signal(signal.SIGKILL)
+            proc.wait()
+            for t in threads:
+                t.join()
+
+            proc = start(server, args, work)
+            conn = Conn()
+            conn.cmd("LOGIN u pw")
+            bad = []
+            for i, acc in enumerate(accs):
+                got = usd_cents(conn, acc) // 100 - base[i]
+                sent, acked = counts[i]
+                if not acked <= got <= sent:
+                    bad.append("%s: %d deposits replayed, %d acked, %d sent"
+                               % (acc, got, acked, sent))
+                base[i] += got
+            if transfers:
+                conn.cmd("LOGIN t pw")
+                total = usd_cents(conn, pair[0]) + usd_cents(conn, pair[1])
+                if total != TRANSFER_FUNDS:
+                    bad.append("transfer accounts hold %d cents, want %d"
+                               % (total, TRANSFER_FUNDS))
+            conn.close()
+
+            acked = sum(c[1] for c in counts)
+            print("%-24s round %d: %6d deposits acked, %s"
+                  % (name, rnd, acked, "ok" if not bad else "FAILED"))
+            for line in bad:
+                print("    " + line)
+            ok = ok and not bad
+        proc.terminate()
+        proc.wait()
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+    return ok
+
+
+def main():
+    server = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./server")
+    ok = True
+    for name, args, transfers in SETUPS:
+        ok = run_setup(server, name, args, transfers) and ok
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()